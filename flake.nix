@@ -36,7 +36,7 @@
               builder = "${pkgs.bash}/bin/bash";
               args = [
                 "-c"
-                "${pkgs.coreutils}/bin/mkdir -p $out/include; ${pkgs.coreutils}/bin/cp ${./threadpool.h} $out/include/threadpool.h"
+                "${pkgs.coreutils}/bin/mkdir -p $out/include; ${pkgs.coreutils}/bin/cp ${./threadpool.h} $out/include/threadpool.h; ${pkgs.coreutils}/bin/cp ${./threadpool.hpp} $out/include/threadpool.hpp"
               ];
             };
           };
@@ -1,5 +1,10 @@
+#define _GNU_SOURCE
+
 #include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
 #define THREADPOOL_IMPLEMENTATION
 #include "threadpool.h"
@@ -91,12 +96,1349 @@ static int thousand_tasks(void)
 	return 0;
 }
 
+static int rate_limited_tasks(void)
+{
+	struct tpool tpool = {0};
+	struct tpool_rate_limit rl;
+	atomic_int counter = 0;
+	struct task tasks[20];
+	struct tpool_batch batch = {0};
+	struct timespec start, end;
+
+	tpool_init(&tpool, (struct tpool_config){.threads_max = 8});
+	tpool_rate_limit_init(&rl, 100, 5);
+
+	for (int i = 0; i < 20; i++) {
+		struct task *t = &tasks[i];
+		t->counter = &counter;
+		t->inner.work = task_work;
+		tpool_batch_push(&batch, tpool_batch_from_task(&t->inner));
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	tpool_schedule_limited(&tpool, &rl, batch);
+	tpool_deinit(&tpool);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (counter != 20) {
+		printf("expected 20, got %d\n", counter);
+		return 1;
+	}
+
+	// 5 tasks are started immediately, 15 others at 100 per second.
+	long elapsed_ms = (end.tv_sec - start.tv_sec) * 1000 +
+			  (end.tv_nsec - start.tv_nsec) / 1000000;
+	if (elapsed_ms < 140) {
+		printf("expected at least 140ms, got %ldms\n", elapsed_ms);
+		return 1;
+	}
+	return 0;
+}
+
+struct burst_task {
+	struct tpool_task inner;
+	atomic_int *started;
+	atomic_int *met;
+};
+
+static void burst_task_work(struct tpool_task *tt)
+{
+	struct burst_task *t = (void *)tt;
+	time_t deadline = time(NULL) + 2;
+
+	// Wait for all tasks of the burst to run concurrently.
+	atomic_fetch_add(t->started, 1);
+	while (atomic_load(t->started) < 4 && time(NULL) < deadline)
+		sched_yield();
+	if (atomic_load(t->started) == 4)
+		atomic_fetch_add(t->met, 1);
+}
+
+static int rate_limited_burst(void)
+{
+	struct tpool tpool = {0};
+	struct tpool_rate_limit rl;
+	atomic_int started = 0, met = 0;
+	struct burst_task tasks[4];
+	struct tpool_batch batch = {0};
+
+	tpool_init(&tpool, (struct tpool_config){.threads_max = 4});
+	tpool_rate_limit_init(&rl, 1, 4);
+
+	for (int i = 0; i < 4; i++) {
+		struct burst_task *t = &tasks[i];
+		*t = (struct burst_task){.inner.work = burst_task_work,
+					 .started = &started,
+					 .met = &met};
+		tpool_batch_push(&batch, tpool_batch_from_task(&t->inner));
+	}
+
+	tpool_schedule_limited(&tpool, &rl, batch);
+	tpool_deinit(&tpool);
+
+	if (atomic_load(&met) != 4) {
+		printf("expected burst to run on 4 threads, %d met\n",
+		       atomic_load(&met));
+		return 1;
+	}
+	return 0;
+}
+
+struct blocking_task {
+	struct tpool_task inner;
+	atomic_int *started;
+	atomic_int *release;
+};
+
+static void blocking_task_work(struct tpool_task *tt)
+{
+	struct blocking_task *t = (void *)tt;
+	atomic_store(t->started, 1);
+	while (atomic_load(t->release) == 0)
+		sched_yield();
+}
+
+static int lane_tasks(void)
+{
+	struct tpool tpool = {0};
+	atomic_int started = 0, release = 0, counter = 0;
+	struct blocking_task bulk = {0};
+	struct task lane = {0};
+
+	tpool_init(&tpool, (struct tpool_config){.threads_max = 1,
+						 .lane_threads = 1});
+
+	// Occupy the only bulk thread.
+	bulk.started = &started;
+	bulk.release = &release;
+	bulk.inner.work = blocking_task_work;
+	tpool_schedule(&tpool, tpool_batch_from_task(&bulk.inner));
+	while (atomic_load(&started) == 0)
+		sched_yield();
+
+	// Reserved thread executes lane task anyway.
+	lane.counter = &counter;
+	lane.inner.work = task_work;
+	tpool_schedule_lane(&tpool, tpool_batch_from_task(&lane.inner));
+	while (atomic_load(&counter) == 0)
+		sched_yield();
+
+	atomic_store(&release, 1);
+	tpool_deinit(&tpool);
+	return 0;
+}
+
+static int busy_poll_tasks(void)
+{
+	struct tpool tpool = {0};
+	atomic_int counter = 0;
+	struct task tasks[100];
+
+	tpool_init(&tpool,
+		   (struct tpool_config){.threads_max = 2, .busy_poll = true});
+
+	for (int i = 0; i < 100; i++) {
+		struct task *t = &tasks[i];
+		t->counter = &counter;
+		t->inner.work = task_work;
+		tpool_schedule(&tpool, tpool_batch_from_task(&t->inner));
+	}
+
+	while (atomic_load(&counter) != 100)
+		sched_yield();
+
+	tpool_deinit(&tpool);
+	return 0;
+}
+
+struct policy_task {
+	struct tpool_task inner;
+	atomic_int policy;
+};
+
+static void policy_task_work(struct tpool_task *tt)
+{
+	struct policy_task *t = (void *)tt;
+	struct sched_param param;
+	int policy;
+
+	pthread_getschedparam(pthread_self(), &policy, &param);
+	atomic_store(&t->policy, policy);
+}
+
+static int sched_policy(void)
+{
+	struct tpool tpool = {0};
+	struct policy_task t = {0};
+
+	tpool_init(&tpool, (struct tpool_config){.threads_max = 1,
+						 .policy = TPOOL_POLICY_BATCH,
+						 .nice = 5});
+
+	atomic_store(&t.policy, -1);
+	t.inner.work = policy_task_work;
+	tpool_schedule(&tpool, tpool_batch_from_task(&t.inner));
+	tpool_deinit(&tpool);
+
+#ifdef SCHED_BATCH
+	if (atomic_load(&t.policy) != SCHED_BATCH) {
+		printf("expected SCHED_BATCH, got %d\n",
+		       atomic_load(&t.policy));
+		return 1;
+	}
+#endif
+
+	// Real-time policy falls back gracefully without permissions.
+	atomic_store(&t.policy, -1);
+	tpool_init(&tpool, (struct tpool_config){.threads_max = 1,
+						 .policy = TPOOL_POLICY_FIFO,
+						 .priority = 1});
+	tpool_schedule(&tpool, tpool_batch_from_task(&t.inner));
+	tpool_deinit(&tpool);
+
+	if (atomic_load(&t.policy) != SCHED_FIFO &&
+	    atomic_load(&t.policy) != SCHED_OTHER) {
+		printf("expected SCHED_FIFO or SCHED_OTHER, got %d\n",
+		       atomic_load(&t.policy));
+		return 1;
+	}
+	return 0;
+}
+
+static int pause_resume(void)
+{
+	struct tpool tpool = {0};
+	atomic_int started = 0, release = 0, counter = 0;
+	struct blocking_task blocking = {0};
+	struct task tasks[10];
+	int err = 0;
+
+	tpool_init(&tpool, (struct tpool_config){.threads_max = 4});
+
+	blocking.started = &started;
+	blocking.release = &release;
+	blocking.inner.work = blocking_task_work;
+	tpool_schedule(&tpool, tpool_batch_from_task(&blocking.inner));
+	while (atomic_load(&started) == 0)
+		sched_yield();
+
+	// Pause returns once blocking task is done.
+	atomic_store(&release, 1);
+	tpool_pause(&tpool);
+
+	for (int i = 0; i < 10; i++) {
+		struct task *t = &tasks[i];
+		t->counter = &counter;
+		t->inner.work = task_work;
+		tpool_schedule(&tpool, tpool_batch_from_task(&t->inner));
+	}
+
+	for (int i = 0; i < 100; i++)
+		sched_yield();
+	if (atomic_load(&counter) != 0) {
+		printf("expected 0, got %d\n", atomic_load(&counter));
+		err = 1;
+	}
+
+	tpool_resume(&tpool);
+	while (atomic_load(&counter) != 10)
+		sched_yield();
+
+	tpool_deinit(&tpool);
+	return err;
+}
+
+static int want_fork(void)
+{
+	struct tpool tpool = {0};
+	atomic_int counter = 0;
+	struct task tasks[10];
+	int err = 0;
+
+	tpool_init(&tpool, (struct tpool_config){.threads_max = 2});
+	if (!tpool_want_fork(&tpool)) {
+		printf("expected idle pool to want forks\n");
+		err = 1;
+	}
+
+	// Queue holds more tasks than threads can take.
+	tpool_pause(&tpool);
+	for (int i = 0; i < 10; i++) {
+		struct task *t = &tasks[i];
+		t->counter = &counter;
+		t->inner.work = task_work;
+		tpool_schedule(&tpool, tpool_batch_from_task(&t->inner));
+	}
+	if (tpool_want_fork(&tpool)) {
+		printf("expected overloaded pool to not want forks\n");
+		err = 1;
+	}
+
+	tpool_resume(&tpool);
+	tpool_wait_idle(&tpool);
+	if (!tpool_want_fork(&tpool)) {
+		printf("expected drained pool to want forks\n");
+		err = 1;
+	}
+
+	tpool_deinit(&tpool);
+	return err;
+}
+
+struct forked_task {
+	struct tpool_task inner;
+	struct tpool_join *join;
+	atomic_int *counter;
+};
+
+static void forked_task_work(struct tpool_task *tt)
+{
+	struct forked_task *t = (void *)tt;
+	atomic_fetch_add(t->counter, 1);
+	tpool_join_done(t->join);
+}
+
+struct forking_task {
+	struct tpool_task inner;
+	struct tpool *pool;
+	struct task queued[10];
+	struct forked_task forks[10];
+	atomic_int counter;
+	bool wanted;
+	int forked;
+};
+
+static void forking_task_work(struct tpool_task *tt)
+{
+	struct forking_task *t = (void *)tt;
+	struct tpool_join join;
+
+	// Only thread is busy, tasks stay on shared queue.
+	for (int i = 0; i < 10; i++) {
+		struct task *q = &t->queued[i];
+		q->counter = &t->counter;
+		q->inner.work = task_work;
+		tpool_schedule(t->pool, tpool_batch_from_task(&q->inner));
+	}
+	t->wanted = tpool_want_fork(t->pool);
+
+	tpool_join_init(&join);
+	while (t->forked < 10 && tpool_want_fork(t->pool)) {
+		struct forked_task *f = &t->forks[t->forked++];
+		f->join = &join;
+		f->counter = &t->counter;
+		f->inner.work = forked_task_work;
+		tpool_fork(t->pool, &join, &f->inner);
+	}
+	tpool_join_wait(t->pool, &join);
+}
+
+static int want_fork_local(void)
+{
+	struct tpool tpool = {0};
+	struct forking_task t = {0};
+
+	tpool_init(&tpool, (struct tpool_config){.threads_max = 1});
+	t.pool = &tpool;
+	t.inner.work = forking_task_work;
+	tpool_schedule(&tpool, tpool_batch_from_task(&t.inner));
+	tpool_deinit(&tpool);
+
+	// Pool thread only looks at its own local queue.
+	if (!t.wanted) {
+		printf("expected empty local queue to want forks\n");
+		return 1;
+	}
+	if (t.forked != TPOOL_FORK_SURPLUS) {
+		printf("expected %d forks, got %d\n", TPOOL_FORK_SURPLUS,
+		       t.forked);
+		return 1;
+	}
+	if (atomic_load(&t.counter) != 10 + t.forked) {
+		printf("expected %d, got %d\n", 10 + t.forked,
+		       atomic_load(&t.counter));
+		return 1;
+	}
+	return 0;
+}
+
+struct affine_task {
+	struct tpool_task inner;
+	pthread_t thread;
+};
+
+static void affine_task_work(struct tpool_task *tt)
+{
+	struct affine_task *t = (void *)tt;
+	t->thread = pthread_self();
+}
+
+static void noop_member(struct tpool_team_member *m, void *ctx)
+{
+	(void)ctx;
+	tpool_team_barrier(m);
+}
+
+static void wait_sleeping(struct tpool *t)
+{
+	// Threads which didn't go to sleep yet may steal, give them time to.
+	tpool_wait_idle(t);
+	usleep(10000);
+}
+
+static int affinity(void)
+{
+	struct tpool tpool = {0};
+	struct tpool_team team;
+	struct affine_task tasks[20];
+	int err = 0;
+
+	tpool_init(&tpool, (struct tpool_config){.threads_max = 4});
+
+	// Spawn all threads so key's thread is idle when tasks are scheduled.
+	tpool_team_run(&tpool, &team, 5, noop_member, NULL);
+	wait_sleeping(&tpool);
+
+	for (int i = 0; i < 20; i++) {
+		tasks[i].inner.work = affine_task_work;
+		tpool_schedule_affine(&tpool, 42,
+				      tpool_batch_from_task(&tasks[i].inner));
+		wait_sleeping(&tpool);
+	}
+
+	for (int i = 1; i < 20; i++) {
+		if (!pthread_equal(tasks[i].thread, tasks[0].thread)) {
+			printf("expected task %d to run on key's thread\n", i);
+			err = 1;
+			break;
+		}
+	}
+
+	tpool_deinit(&tpool);
+	return err;
+}
+
+struct sticky_task {
+	struct tpool_task inner;
+	struct tpool_future *future;
+	struct tpool_task *continuation;
+	unsigned int worker;
+};
+
+struct sticky_continuation {
+	struct tpool_task inner;
+	unsigned int worker;
+};
+
+static void sticky_task_work(struct tpool_task *tt)
+{
+	struct sticky_task *t = (void *)tt;
+	t->worker = tpool_worker_id();
+	tpool_future_then(tpool_current(), t->future, t->continuation);
+}
+
+static void sticky_continuation_work(struct tpool_task *tt)
+{
+	struct sticky_continuation *c = (void *)tt;
+	c->worker = tpool_worker_id();
+}
+
+static int sticky_continuation(void)
+{
+	struct tpool tpool = {0};
+	struct tpool_team team;
+	struct tpool_future future;
+	struct sticky_task task;
+	struct sticky_continuation cont;
+	atomic_int counter = 0;
+	struct task early = {.inner.work = task_work, .counter = &counter};
+	int err = 0;
+
+	// Pool without threads has no local queue yet.
+	tpool_init(&tpool, (struct tpool_config){.threads_max = 4});
+	tpool_resume_on(&tpool, 0, &early.inner);
+	tpool_team_run(&tpool, &team, 5, noop_member, NULL);
+	tpool_wait_idle(&tpool);
+	if (atomic_load(&counter) != 1) {
+		printf("expected early task to run, got %d\n",
+		       atomic_load(&counter));
+		err = 1;
+	}
+
+	if (tpool_worker_id() != UINT_MAX) {
+		printf("expected no worker id outside of pool\n");
+		err = 1;
+	}
+
+	for (int i = 0; i < 20; i++) {
+		tpool_future_init(&future);
+		task = (struct sticky_task){.inner.work = sticky_task_work,
+					    .future = &future,
+					    .continuation = &cont.inner};
+		cont = (struct sticky_continuation){
+		    .inner.work = sticky_continuation_work};
+		tpool_schedule(&tpool, tpool_batch_from_task(&task.inner));
+		tpool_wait_idle(&tpool);
+
+		// Worker is sleeping when continuation is resumed.
+		tpool_future_set(&future, NULL);
+		tpool_wait_idle(&tpool);
+		if (task.worker >= 4 || cont.worker != task.worker) {
+			printf("expected continuation on worker %u, got %u\n",
+			       task.worker, cont.worker);
+			err = 1;
+			break;
+		}
+	}
+
+	tpool_deinit(&tpool);
+	return err;
+}
+
+static int paused_continuation(void)
+{
+	struct tpool tpool = {0};
+	struct tpool_future future;
+	struct sticky_task task;
+	struct sticky_continuation cont = {.inner.work =
+						sticky_continuation_work};
+	int err = 0;
+
+	tpool_init(&tpool, (struct tpool_config){.threads_max = 2});
+	tpool_future_init(&future);
+	task = (struct sticky_task){.inner.work = sticky_task_work,
+				    .future = &future,
+				    .continuation = &cont.inner};
+	tpool_schedule(&tpool, tpool_batch_from_task(&task.inner));
+	tpool_wait_idle(&tpool);
+
+	// Continuation lands in the inbox of a paused worker.
+	tpool_pause(&tpool);
+	tpool_future_set(&future, NULL);
+	usleep(10000);
+	tpool_resume(&tpool);
+	tpool_wait_idle(&tpool);
+	if (cont.worker != task.worker) {
+		printf("expected continuation on worker %u, got %u\n",
+		       task.worker, cont.worker);
+		err = 1;
+	}
+
+	tpool_deinit(&tpool);
+	return err;
+}
+
+static atomic_int idle_calls = 0;
+
+static void idle_fn(struct tpool *t)
+{
+	(void)t;
+	atomic_fetch_add(&idle_calls, 1);
+}
+
+static int wait_idle(void)
+{
+	struct tpool tpool = {0};
+	atomic_int counter = 0;
+	struct task tasks[100];
+	struct tpool_batch batch = {0};
+
+	tpool_init(&tpool, (struct tpool_config){.threads_max = 4,
+						 .idle_fn = idle_fn});
+
+	// Idle pool doesn't block.
+	tpool_wait_idle(&tpool);
+
+	for (int i = 0; i < 100; i++) {
+		struct task *t = &tasks[i];
+		t->counter = &counter;
+		t->inner.work = task_work;
+		tpool_batch_push(&batch, tpool_batch_from_task(&t->inner));
+	}
+
+	tpool_schedule(&tpool, batch);
+	tpool_wait_idle(&tpool);
+	int count = atomic_load(&counter);
+	tpool_deinit(&tpool);
+
+	if (count != 100) {
+		printf("expected 100, got %d\n", count);
+		return 1;
+	}
+	if (atomic_load(&idle_calls) < 1) {
+		printf("expected idle callback to be called\n");
+		return 1;
+	}
+	return 0;
+}
+
+struct team_ctx {
+	atomic_int counter;
+	atomic_int errors;
+};
+
+static void team_fn(struct tpool_team_member *m, void *ptr)
+{
+	struct team_ctx *ctx = ptr;
+
+	for (int i = 1; i <= 1000; i++) {
+		atomic_fetch_add(&ctx->counter, 1);
+		tpool_team_barrier(m);
+
+		// All members incremented counter before anyone reads it.
+		if (atomic_load(&ctx->counter) != i * (int)m->team->size)
+			atomic_fetch_add(&ctx->errors, 1);
+		tpool_team_barrier(m);
+	}
+}
+
+static int team_barrier(void)
+{
+	struct tpool tpool = {0};
+	struct tpool_team team;
+	struct team_ctx ctx = {0};
+
+	tpool_init(&tpool, (struct tpool_config){.threads_max = 3});
+
+	int size = tpool_team_run(&tpool, &team, 4, team_fn, &ctx);
+	tpool_deinit(&tpool);
+
+	if (size != 4) {
+		printf("expected team of 4, got %d\n", size);
+		return 1;
+	}
+	if (atomic_load(&ctx.errors) != 0) {
+		printf("expected no errors, got %d\n",
+		       atomic_load(&ctx.errors));
+		return 1;
+	}
+	return 0;
+}
+
+struct loop_ctx {
+	atomic_int hits[1000];
+	atomic_int calls;
+};
+
+static void loop_fn(void *ptr, size_t begin, size_t end)
+{
+	struct loop_ctx *ctx = ptr;
+
+	atomic_fetch_add(&ctx->calls, 1);
+	for (size_t i = begin; i < end; i++)
+		atomic_fetch_add(&ctx->hits[i], 1);
+}
+
+static int check_loop(struct loop_ctx *ctx, size_t begin, size_t end)
+{
+	for (size_t i = 0; i < 1000; i++) {
+		int expected = i >= begin && i < end ? 1 : 0;
+		if (atomic_load(&ctx->hits[i]) != expected) {
+			printf("expected %d hits at %zu, got %d\n", expected,
+			       i, atomic_load(&ctx->hits[i]));
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int parallel_for_static(void)
+{
+	struct tpool tpool = {0};
+	static struct loop_ctx ctx;
+	int err = 0;
+
+	tpool_init(&tpool, (struct tpool_config){.threads_max = 3});
+
+	// One contiguous block per worker.
+	tpool_parallel_for(&tpool, 3, 998, 4, (struct tpool_loop){0}, loop_fn,
+			   &ctx);
+	err = check_loop(&ctx, 3, 998);
+	if (!err && atomic_load(&ctx.calls) != 4) {
+		printf("expected 4 calls, got %d\n", atomic_load(&ctx.calls));
+		err = 1;
+	}
+
+	// Block cyclic.
+	ctx = (struct loop_ctx){0};
+	if (!err)
+		tpool_parallel_for(&tpool, 0, 1000, 4,
+				   (struct tpool_loop){.schedule =
+							   TPOOL_LOOP_CYCLIC,
+						       .chunk = 10},
+				   loop_fn, &ctx);
+	if (!err)
+		err = check_loop(&ctx, 0, 1000);
+	if (!err && atomic_load(&ctx.calls) != 100) {
+		printf("expected 100 calls, got %d\n",
+		       atomic_load(&ctx.calls));
+		err = 1;
+	}
+
+	tpool_deinit(&tpool);
+	return err;
+}
+
+static void team_loops_fn(struct tpool_team_member *m, void *ctx)
+{
+	// Consecutive dynamic loops share team's cursors.
+	for (int i = 0; i < 3; i++)
+		tpool_team_for(m, 0, 1000,
+			       (struct tpool_loop){.schedule =
+						       TPOOL_LOOP_GUIDED},
+			       loop_fn, ctx);
+}
+
+static void nowait_loops_fn(struct tpool_team_member *m, void *ctx)
+{
+	// Members may still claim chunks of the first loop while others run
+	// the second one.
+	tpool_team_for(m, 0, 100,
+		       (struct tpool_loop){.schedule = TPOOL_LOOP_GUIDED,
+					   .nowait = true},
+		       loop_fn, ctx);
+	tpool_team_for(m, 0, 100, (struct tpool_loop){0}, loop_fn, ctx);
+}
+
+static int parallel_for_dynamic(void)
+{
+	struct tpool tpool = {0};
+	static struct loop_ctx ctx;
+	enum tpool_loop_schedule schedules[] = {TPOOL_LOOP_GUIDED,
+						TPOOL_LOOP_ADAPTIVE};
+	int err = 0;
+
+	tpool_init(&tpool, (struct tpool_config){.threads_max = 3});
+
+	for (size_t i = 0; i < 2 && !err; i++) {
+		ctx = (struct loop_ctx){0};
+		tpool_parallel_for(
+		    &tpool, 0, 1000, 4,
+		    (struct tpool_loop){.schedule = schedules[i], .chunk = 4},
+		    loop_fn, &ctx);
+		err = check_loop(&ctx, 0, 1000);
+	}
+
+	struct tpool_team team;
+	ctx = (struct loop_ctx){0};
+	if (!err)
+		tpool_team_run(&tpool, &team, 4, team_loops_fn, &ctx);
+	for (size_t i = 0; i < 1000 && !err; i++) {
+		if (atomic_load(&ctx.hits[i]) != 3) {
+			printf("expected 3 hits at %zu, got %d\n", i,
+			       atomic_load(&ctx.hits[i]));
+			err = 1;
+		}
+	}
+
+	for (int run = 0; run < 100 && !err; run++) {
+		ctx = (struct loop_ctx){0};
+		tpool_team_run(&tpool, &team, 4, nowait_loops_fn, &ctx);
+		for (size_t i = 0; i < 100 && !err; i++) {
+			if (atomic_load(&ctx.hits[i]) != 2) {
+				printf("expected 2 hits at %zu, got %d\n", i,
+				       atomic_load(&ctx.hits[i]));
+				err = 1;
+			}
+		}
+	}
+
+	tpool_deinit(&tpool);
+	return err;
+}
+
+struct nested_task {
+	struct tpool_task inner;
+	struct tpool *pool;
+	struct loop_ctx *loops;
+	atomic_int *started;
+	int tasks;
+};
+
+static void nested_task_work(struct tpool_task *tt)
+{
+	struct nested_task *t = (void *)tt;
+
+	// All threads are busy once tasks started.
+	atomic_fetch_add(t->started, 1);
+	while (atomic_load(t->started) < t->tasks)
+		sched_yield();
+	tpool_parallel_for(t->pool, 0, 1000, 0, (struct tpool_loop){0},
+			   loop_fn, t->loops);
+}
+
+static void nested_member(struct tpool_team_member *m, void *ptr)
+{
+	struct nested_task *t = ptr;
+	tpool_team_barrier(m);
+	tpool_parallel_for(t->pool, 0, 1000, 0, (struct tpool_loop){0},
+			   loop_fn, t->loops);
+	tpool_team_barrier(m);
+}
+
+static int check_hits(struct loop_ctx *ctx, int expected)
+{
+	for (size_t i = 0; i < 1000; i++) {
+		if (atomic_load(&ctx->hits[i]) != expected) {
+			printf("expected %d hits at %zu, got %d\n", expected,
+			       i, atomic_load(&ctx->hits[i]));
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int nested_teams(void)
+{
+	struct tpool tpool = {0};
+	static struct loop_ctx ctx;
+	struct nested_task tasks[4];
+	struct tpool_team team;
+	atomic_int started = 0;
+	int err = 0;
+
+	// Loop in a task of a single thread pool runs on calling thread.
+	tpool_init(&tpool, (struct tpool_config){.threads_max = 1});
+	tasks[0] = (struct nested_task){.inner.work = nested_task_work,
+					.pool = &tpool,
+					.loops = &ctx,
+					.started = &started,
+					.tasks = 1};
+	tpool_schedule(&tpool, tpool_batch_from_task(&tasks[0].inner));
+	tpool_wait_idle(&tpool);
+	tpool_deinit(&tpool);
+	err = check_hits(&ctx, 1);
+
+	// Tasks keeping all threads busy run loops concurrently.
+	tpool_init(&tpool, (struct tpool_config){.threads_max = 4});
+	ctx = (struct loop_ctx){0};
+	started = 0;
+	for (int i = 0; i < 4; i++) {
+		tasks[i] = (struct nested_task){.inner.work = nested_task_work,
+						.pool = &tpool,
+						.loops = &ctx,
+						.started = &started,
+						.tasks = 4};
+		tpool_schedule(&tpool, tpool_batch_from_task(&tasks[i].inner));
+	}
+	tpool_wait_idle(&tpool);
+	if (!err)
+		err = check_hits(&ctx, 4);
+
+	// Teams nested in team functions.
+	ctx = (struct loop_ctx){0};
+	tpool_team_run(&tpool, &team, 4, nested_member, &tasks[0]);
+	if (!err)
+		err = check_hits(&ctx, 4);
+
+	tpool_deinit(&tpool);
+	return err;
+}
+
+struct paused_task {
+	struct tpool_task inner;
+	struct tpool *pool;
+	struct loop_ctx *loops;
+	struct forked_task child;
+	atomic_int forked;
+	atomic_int started;
+	atomic_int go;
+};
+
+static void paused_task_work(struct tpool_task *tt)
+{
+	struct paused_task *t = (void *)tt;
+	struct tpool_join join;
+
+	atomic_store(&t->started, 1);
+	while (!atomic_load(&t->go))
+		sched_yield();
+
+	// Pool is flagged paused by then, task can't be done without its
+	// child and its team.
+	usleep(10000);
+	tpool_join_init(&join);
+	t->child = (struct forked_task){.inner.work = forked_task_work,
+					.join = &join,
+					.counter = &t->forked};
+	tpool_fork(t->pool, &join, &t->child.inner);
+	tpool_join_wait(t->pool, &join);
+	tpool_parallel_for(t->pool, 0, 1000, 0, (struct tpool_loop){0},
+			   loop_fn, t->loops);
+}
+
+static int paused_joins(void)
+{
+	struct tpool tpool = {0};
+	static struct loop_ctx ctx;
+	struct paused_task task = {.inner.work = paused_task_work,
+				   .pool = &tpool,
+				   .loops = &ctx};
+	int err = 0;
+
+	tpool_init(&tpool, (struct tpool_config){.threads_max = 2});
+	tpool_schedule(&tpool, tpool_batch_from_task(&task.inner));
+	while (!atomic_load(&task.started))
+		sched_yield();
+	atomic_store(&task.go, 1);
+	tpool_pause(&tpool);
+
+	if (atomic_load(&task.forked) != 1) {
+		printf("expected forked task to run while pausing\n");
+		err = 1;
+	}
+	if (!err)
+		err = check_hits(&ctx, 1);
+
+	tpool_resume(&tpool);
+	tpool_deinit(&tpool);
+	return err;
+}
+
+struct tiles_ctx {
+	atomic_int hits[20][30][40];
+	atomic_int tiles;
+};
+
+static void tiles_fn(void *ptr, const struct tpool_box *box)
+{
+	struct tiles_ctx *ctx = ptr;
+
+	atomic_fetch_add(&ctx->tiles, 1);
+	for (size_t z = box->begin[2]; z < box->end[2]; z++)
+		for (size_t y = box->begin[1]; y < box->end[1]; y++)
+			for (size_t x = box->begin[0]; x < box->end[0]; x++)
+				atomic_fetch_add(&ctx->hits[z][y][x], 1);
+}
+
+static int parallel_for_tiles(void)
+{
+	struct tpool tpool = {0};
+	static struct tiles_ctx ctx;
+	enum tpool_tile_order orders[] = {TPOOL_TILE_SPLIT, TPOOL_TILE_MORTON,
+					  TPOOL_TILE_HILBERT};
+	int err = 0;
+
+	tpool_init(&tpool, (struct tpool_config){.threads_max = 3});
+
+	for (size_t i = 0; i < 3 && !err; i++) {
+		struct tpool_tiling tiling = {.tile = {8, 4, 16},
+					      .order = orders[i]};
+
+		// 2D loop over [2, 39) x [1, 30), 5 x 8 tiles.
+		ctx = (struct tiles_ctx){0};
+		tpool_parallel_for_2d(&tpool,
+				      (struct tpool_box){{2, 1}, {39, 30}},
+				      tiling, tiles_fn, &ctx);
+		for (size_t y = 0; y < 30; y++)
+			for (size_t x = 0; x < 40; x++)
+				if (atomic_load(&ctx.hits[0][y][x]) !=
+				    (x >= 2 && x < 39 && y >= 1))
+					err = 1;
+		if (atomic_load(&ctx.tiles) != 40)
+			err = 1;
+
+		// 3D loop over whole array, 5 x 8 x 2 tiles.
+		ctx = (struct tiles_ctx){0};
+		tpool_parallel_for_3d(
+		    &tpool, (struct tpool_box){{0, 0, 0}, {40, 30, 20}}, tiling,
+		    tiles_fn, &ctx);
+		atomic_int *hits = &ctx.hits[0][0][0];
+		for (size_t j = 0; j < 20 * 30 * 40; j++)
+			if (atomic_load(&hits[j]) != 1)
+				err = 1;
+		if (atomic_load(&ctx.tiles) != 80)
+			err = 1;
+
+		if (err)
+			printf("wrong tiling with order %d\n", orders[i]);
+	}
+
+	tpool_deinit(&tpool);
+	return err;
+}
+
+struct pipeline_ctx {
+	long items[4];
+	long produced;
+	long consumed;
+	int errors;
+};
+
+static bool pipeline_input(void *ptr, struct tpool_pipeline_token *tok)
+{
+	struct pipeline_ctx *ctx = ptr;
+
+	if (ctx->produced == 1000)
+		return false;
+	ctx->items[tok->id] = ctx->produced++;
+	tok->item = &ctx->items[tok->id];
+	return true;
+}
+
+static bool pipeline_square(void *ptr, struct tpool_pipeline_token *tok)
+{
+	long *item = tok->item;
+	(void)ptr;
+	*item = *item * *item;
+	return true;
+}
+
+static bool pipeline_output(void *ptr, struct tpool_pipeline_token *tok)
+{
+	struct pipeline_ctx *ctx = ptr;
+	long *item = tok->item;
+
+	// Serial stage sees items in input order.
+	if (*item != ctx->consumed * ctx->consumed)
+		ctx->errors++;
+	ctx->consumed++;
+	return true;
+}
+
+static int pipeline(void)
+{
+	struct tpool tpool = {0};
+	struct pipeline_ctx ctx = {0};
+	struct tpool_pipeline_token tokens[4];
+	struct tpool_pipeline_stage stages[] = {
+	    {.fn = pipeline_input, .ctx = &ctx},
+	    {.mode = TPOOL_STAGE_PARALLEL, .fn = pipeline_square},
+	    {.mode = TPOOL_STAGE_SERIAL, .fn = pipeline_output, .ctx = &ctx},
+	};
+
+	tpool_init(&tpool, (struct tpool_config){.threads_max = 4});
+	tpool_pipeline_run(&tpool, stages, 3, tokens, 4);
+	tpool_deinit(&tpool);
+
+	if (ctx.consumed != 1000 || ctx.errors != 0) {
+		printf("expected 1000 items in order, got %ld with %d errors\n",
+		       ctx.consumed, ctx.errors);
+		return 1;
+	}
+	return 0;
+}
+
+struct file_ctx {
+	atomic_long lines;
+	unsigned long merged;
+	size_t offset;
+	int errors;
+};
+
+static void file_process(void *ptr, const struct tpool_file_chunk *c)
+{
+	struct file_ctx *ctx = ptr;
+	long lines = 0;
+
+	for (size_t i = 0; i < c->len; i++)
+		if (c->data[i] == '\n')
+			lines++;
+	atomic_fetch_add(&ctx->lines, lines);
+}
+
+static void file_merge(void *ptr, const struct tpool_file_chunk *c)
+{
+	struct file_ctx *ctx = ptr;
+
+	// Chunks are merged in order and end on a record boundary.
+	if (c->index != ctx->merged++ || c->offset != ctx->offset ||
+	    c->data[c->len - 1] != '\n')
+		ctx->errors++;
+	ctx->offset += c->len;
+}
+
+static int file_scan(void)
+{
+	struct tpool tpool = {0};
+	struct file_ctx ctx = {0};
+	char path[] = "/tmp/threadpool-test-XXXXXX";
+	int fd, err;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return 1;
+	FILE *f = fdopen(fd, "w");
+	for (int i = 0; i < 100000; i++)
+		fprintf(f, "line %d\n", i);
+	fclose(f);
+
+	tpool_init(&tpool, (struct tpool_config){.threads_max = 4});
+	err = tpool_file_scan(
+	    &tpool, path,
+	    (struct tpool_file_config){.chunk_size = 4096,
+				       .process = file_process,
+				       .merge = file_merge,
+				       .ctx = &ctx});
+	tpool_deinit(&tpool);
+	unlink(path);
+
+	if (err != 0) {
+		printf("file scan failed: %d\n", err);
+		return 1;
+	}
+	if (atomic_load(&ctx.lines) != 100000 || ctx.errors != 0) {
+		printf("expected 100000 lines, got %ld with %d errors\n",
+		       atomic_load(&ctx.lines), ctx.errors);
+		return 1;
+	}
+	return 0;
+}
+
+static void invoke_fn(void *ptr)
+{
+	atomic_fetch_add((atomic_int *)ptr, 1);
+}
+
+struct when_ctx {
+	struct tpool_when *when;
+	atomic_int started;
+	bool spin;
+};
+
+static void when_fn(void *ptr)
+{
+	struct when_ctx *ctx = ptr;
+	time_t deadline = time(NULL) + 2;
+
+	atomic_fetch_add(&ctx->started, 1);
+	while (ctx->spin && !tpool_when_cancelled(ctx->when) &&
+	       time(NULL) < deadline)
+		sched_yield();
+}
+
+static int when_any(void)
+{
+	struct tpool tpool = {0};
+	struct tpool_when when;
+	atomic_int counters[3] = {0};
+	struct when_ctx ctx[3] = {
+	    {.when = &when, .spin = true},
+	    {.when = &when, .spin = false},
+	    {.when = &when, .spin = true},
+	};
+	int err = 0;
+
+	tpool_init(&tpool, (struct tpool_config){.threads_max = 4});
+
+	TPOOL_PARALLEL_INVOKE(&tpool, {invoke_fn, &counters[0]},
+			      {invoke_fn, &counters[1]},
+			      {invoke_fn, &counters[2]},
+			      {invoke_fn, &counters[1]});
+	if (atomic_load(&counters[0]) != 1 || atomic_load(&counters[1]) != 2 ||
+	    atomic_load(&counters[2]) != 1) {
+		printf("parallel invoke skipped functions\n");
+		err = 1;
+	}
+
+	size_t first = tpool_when_any(
+	    &tpool, &when,
+	    (struct tpool_invoke[]){
+		{when_fn, &ctx[0]}, {when_fn, &ctx[1]}, {when_fn, &ctx[2]}},
+	    3);
+	if (first != 1) {
+		printf("expected function 1 to return first, got %zu\n", first);
+		err = 1;
+	}
+
+	// Starting a group clears previous cancellation.
+	tpool_when_cancel(&when);
+	for (int i = 0; i < 3; i++)
+		atomic_store(&ctx[i].started, 0);
+	tpool_when_all(&tpool, &when,
+		       (struct tpool_invoke[]){{when_fn, &ctx[1]}}, 1);
+	if (atomic_load(&ctx[1].started) != 1) {
+		printf("when all didn't run function\n");
+		err = 1;
+	}
+
+	tpool_deinit(&tpool);
+	return err;
+}
+
+struct square_task {
+	struct tpool_task task;
+	struct tpool_future result;
+	long n;
+};
+
+static void square_work(struct tpool_task *task)
+{
+	struct square_task *st = (struct square_task *)task;
+	tpool_future_set(&st->result, (void *)(st->n * st->n));
+}
+
+struct plus_one_task {
+	struct tpool_task task;
+	struct tpool_future *input;
+	struct tpool_future result;
+};
+
+static void plus_one_work(struct tpool_task *task)
+{
+	struct plus_one_task *pt = (struct plus_one_task *)task;
+	long n = (long)tpool_future_get(pt->input);
+	tpool_future_set(&pt->result, (void *)(n + 1));
+}
+
+static int future(void)
+{
+	struct tpool tpool = {0};
+	struct square_task squares[64];
+	struct plus_one_task plus[64];
+	int err = 0;
+
+	tpool_init(&tpool, (struct tpool_config){.threads_max = 4});
+	for (long i = 0; i < 64; i++) {
+		squares[i].task.work = square_work;
+		squares[i].n = i;
+		tpool_future_init(&squares[i].result);
+		plus[i].task.work = plus_one_work;
+		plus[i].input = &squares[i].result;
+		tpool_future_init(&plus[i].result);
+
+		// Attach continuation before or after completion.
+		if (i % 2 == 0)
+			tpool_future_then(&tpool, &squares[i].result,
+					  &plus[i].task);
+		tpool_schedule(&tpool,
+			       tpool_batch_from_task(&squares[i].task));
+		if (i % 2 == 1)
+			tpool_future_then(&tpool, &squares[i].result,
+					  &plus[i].task);
+	}
+
+	for (long i = 0; i < 64; i++) {
+		long n = (long)tpool_future_get(&plus[i].result);
+		if (n != i * i + 1) {
+			printf("expected future %ld to be %ld, got %ld\n", i,
+			       i * i + 1, n);
+			err = 1;
+		}
+	}
+
+	tpool_deinit(&tpool);
+	return err;
+}
+
+struct word {
+	struct tpool_mr_entry entry;
+	int key;
+	int count;
+};
+
+struct mr_ctx {
+	struct word *words;
+	int counts[1000];
+	atomic_int reduced;
+};
+
+static void mr_map(void *ptr, struct tpool_mr_shard *s, size_t begin,
+		   size_t end)
+{
+	struct mr_ctx *ctx = ptr;
+
+	for (size_t i = begin; i < end; i++) {
+		struct word *w = &ctx->words[i];
+		w->key = (int)(i % 1000);
+		w->count = 1;
+		w->entry.hash = (i % 1000) * 0x9e3779b97f4a7c15ULL;
+		tpool_mr_emit(s, &w->entry);
+	}
+}
+
+static bool mr_eq(void *ptr, const struct tpool_mr_entry *a,
+		  const struct tpool_mr_entry *b)
+{
+	(void)ptr;
+	return ((const struct word *)a)->key == ((const struct word *)b)->key;
+}
+
+static void mr_combine(void *ptr, struct tpool_mr_entry *dst,
+		       struct tpool_mr_entry *src)
+{
+	(void)ptr;
+	((struct word *)dst)->count += ((struct word *)src)->count;
+}
+
+static void mr_reduce(void *ptr, struct tpool_mr_entry *e)
+{
+	struct mr_ctx *ctx = ptr;
+	struct word *w = (struct word *)e;
+
+	// Each key is reduced once, no synchronization needed.
+	ctx->counts[w->key] += w->count;
+	atomic_fetch_add(&ctx->reduced, 1);
+}
+
+static int mapreduce(void)
+{
+	struct tpool tpool = {0};
+	struct mr_ctx ctx = {0};
+	int err;
+
+	ctx.words = calloc(100000, sizeof(*ctx.words));
+	tpool_init(&tpool, (struct tpool_config){.threads_max = 4});
+	err = tpool_mapreduce(
+	    &tpool, 0, 100000,
+	    (struct tpool_mr_config){.loop = {.schedule = TPOOL_LOOP_GUIDED,
+					      .chunk = 64},
+				     .map = mr_map,
+				     .eq = mr_eq,
+				     .combine = mr_combine,
+				     .reduce = mr_reduce,
+				     .ctx = &ctx});
+	tpool_deinit(&tpool);
+	free(ctx.words);
+
+	if (err != 0) {
+		printf("mapreduce failed: %d\n", err);
+		return 1;
+	}
+	if (atomic_load(&ctx.reduced) != 1000) {
+		printf("expected 1000 keys, got %d\n",
+		       atomic_load(&ctx.reduced));
+		return 1;
+	}
+	for (int i = 0; i < 1000; i++) {
+		if (ctx.counts[i] != 100) {
+			printf("expected key %d count to be 100, got %d\n", i,
+			       ctx.counts[i]);
+			return 1;
+		}
+	}
+	return 0;
+}
+
 int main(void)
 {
 	printf("executing tests...\n");
 	TRY(init_deinit);
 	TRY(single_task);
 	TRY(thousand_tasks);
+	TRY(rate_limited_tasks);
+	TRY(rate_limited_burst);
+	TRY(lane_tasks);
+	TRY(busy_poll_tasks);
+	TRY(sched_policy);
+	TRY(pause_resume);
+	TRY(want_fork);
+	TRY(want_fork_local);
+	TRY(affinity);
+	TRY(sticky_continuation);
+	TRY(paused_continuation);
+	TRY(wait_idle);
+	TRY(team_barrier);
+	TRY(parallel_for_static);
+	TRY(parallel_for_dynamic);
+	TRY(nested_teams);
+	TRY(paused_joins);
+	TRY(parallel_for_tiles);
+	TRY(pipeline);
+	TRY(file_scan);
+	TRY(mapreduce);
+	TRY(when_any);
+	TRY(future);
 	printf("all tests are ok\n");
 	return 0;
 }
@@ -0,0 +1,572 @@
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <memory_resource>
+#include <numeric>
+#include <random>
+#include <vector>
+#include <stdexcept>
+#include <thread>
+
+#include "threadpool.hpp"
+
+#define TRY(fn)                                                                \
+	do {                                                                   \
+		int err = fn();                                                \
+		if (err) {                                                     \
+			printf("KO	%s: %d\n", #fn, err);                  \
+			return err;                                            \
+		} else {                                                       \
+			printf("OK	%s\n", #fn);                           \
+		}                                                              \
+	} while (0)
+
+static tpool_config config(unsigned int threads_max)
+{
+	tpool_config cfg{};
+	cfg.threads_max = threads_max;
+	return cfg;
+}
+
+static int lambda_tasks()
+{
+	std::atomic<int> counter{0};
+	{
+		threadpool::pool pool(config(4));
+		for (int i = 0; i < 10000; i++)
+			pool.submit([&counter] { counter++; });
+		pool.wait_idle();
+	}
+
+	if (counter != 10000) {
+		printf("expected counter to be 10000, got %d\n",
+		       counter.load());
+		return 1;
+	}
+	return 0;
+}
+
+struct tracked {
+	std::atomic<int> *destroyed;
+	std::array<char, 128> payload{};
+
+	explicit tracked(std::atomic<int> *d) : destroyed(d) {}
+	tracked(tracked &&o) noexcept
+	    : destroyed(std::exchange(o.destroyed, nullptr)), payload(o.payload)
+	{
+	}
+	~tracked()
+	{
+		if (destroyed != nullptr)
+			(*destroyed)++;
+	}
+};
+
+static int move_only_tasks()
+{
+	std::atomic<int> sum{0}, destroyed{0};
+	{
+		threadpool::pool pool(config(4));
+		for (int i = 0; i < 100; i++) {
+			// Inline and heap stored callables.
+			auto value = std::make_unique<int>(i);
+			pool.submit(
+			    [&sum, v = std::move(value)] { sum += *v; });
+			pool.submit([&sum, t = tracked(&destroyed)] {
+				sum += static_cast<int>(t.payload.size());
+			});
+		}
+	}
+
+	if (sum != 4950 + 100 * 128 || destroyed != 100) {
+		printf("expected sum %d and 100 destroyed, got %d and %d\n",
+		       4950 + 100 * 128, sum.load(), destroyed.load());
+		return 1;
+	}
+	return 0;
+}
+
+using metered_pool =
+    threadpool::basic_pool<threadpool::policy::batched_queue<16>,
+			   threadpool::policy::counting_metrics,
+			   threadpool::policy::no_lane>;
+
+static_assert(sizeof(threadpool::pool) == sizeof(tpool),
+	      "disabled policies must not take space");
+
+static int policy_pools()
+{
+	std::atomic<int> counter{0};
+	metered_pool pool(config(4));
+
+	// 1000 isn't a multiple of batch size, last tasks are flushed by
+	// wait_idle().
+	for (int i = 0; i < 1000; i++)
+		pool.submit([&counter] { counter++; });
+	pool.wait_idle();
+
+	threadpool::pool_metrics m = pool.metrics();
+	if (counter != 1000 || m.submitted != 1000 || m.completed != 1000) {
+		printf("expected 1000 tasks, got %d (%llu submitted, %llu "
+		       "completed)\n",
+		       counter.load(), m.submitted, m.completed);
+		return 1;
+	}
+
+	// Threads need work, a lone task isn't held back in the buffer.
+	pool.submit([&counter] { counter++; });
+	while (counter != 1001)
+		std::this_thread::yield();
+
+	// Tasks still buffered are flushed by destructor.
+	std::atomic<int> late{0};
+	{
+		threadpool::basic_pool<threadpool::policy::batched_queue<16>>
+		    batched(config(1));
+		batched.submit([&batched, &late] {
+			for (int i = 0; i < 100; i++)
+				batched.submit([&late] { late++; });
+		});
+	}
+	if (late != 100) {
+		printf("expected 100 late tasks, got %d\n", late.load());
+		return 1;
+	}
+	return 0;
+}
+
+static void sum_tree(threadpool::task_group &g, std::atomic<int> &sum,
+		     int depth)
+{
+	sum++;
+	if (depth == 0)
+		return;
+	for (int i = 0; i < 2; i++)
+		g.run([&g, &sum, depth] { sum_tree(g, sum, depth - 1); });
+}
+
+static int task_groups()
+{
+	threadpool::pool pool(config(4));
+
+	// Tasks reference the stack and spawn children in their group.
+	std::atomic<int> sum{0};
+	{
+		threadpool::task_group g(pool);
+		sum_tree(g, sum, 9);
+	}
+	if (sum != 1023) {
+		printf("expected 1023 tasks, got %d\n", sum.load());
+		return 1;
+	}
+
+	threadpool::task_group g(pool);
+	for (int i = 0; i < 100; i++) {
+		g.run([i] {
+			if (i == 42)
+				throw std::runtime_error("failed");
+		});
+	}
+	try {
+		g.wait();
+		printf("expected wait() to rethrow task exception\n");
+		return 1;
+	} catch (const std::runtime_error &) {
+	}
+
+	// Group is reusable after wait().
+	g.run([&sum] { sum++; });
+	g.wait();
+	if (sum != 1024) {
+		printf("expected reused group to run its task\n");
+		return 1;
+	}
+	return 0;
+}
+
+static long fib(int n) { return n < 2 ? n : fib(n - 1) + fib(n - 2); }
+
+static int fork_join()
+{
+	threadpool::pool pool(config(4));
+	auto split = [](int n) -> std::optional<std::pair<int, int>> {
+		if (n < 2)
+			return std::nullopt;
+		return std::pair{n - 1, n - 2};
+	};
+
+	long r = threadpool::fork_join(pool, 30, split, fib, std::plus<>());
+	if (r != 832040) {
+		printf("expected fib(30) to be 832040, got %ld\n", r);
+		return 1;
+	}
+
+	try {
+		threadpool::fork_join(
+		    pool, 20, split,
+		    [](int) -> long { throw std::runtime_error("failed"); },
+		    std::plus<>());
+		printf("expected fork_join() to rethrow solve exception\n");
+		return 1;
+	} catch (const std::runtime_error &) {
+	}
+	return 0;
+}
+
+static int parallel_algorithms()
+{
+	threadpool::pool pool(config(4));
+	threadpool::par::use(pool);
+
+	std::vector<long> v(100000);
+	std::iota(v.begin(), v.end(), 1);
+
+	threadpool::par::for_each(v.begin(), v.end(), [](long &x) { x *= 2; });
+	long sum = threadpool::par::reduce(v.begin(), v.end());
+	if (sum != 100000L * 100001L) {
+		printf("unexpected for_each/reduce sum %ld\n", sum);
+		return 1;
+	}
+
+	long half = threadpool::par::transform_reduce(
+	    v.begin(), v.end(), 0L, std::plus<>(),
+	    [](long x) { return x / 2; });
+	if (half != 100000L * 100001L / 2) {
+		printf("unexpected transform_reduce result %ld\n", half);
+		return 1;
+	}
+
+	std::vector<long> inc(v.size()), exc(v.size());
+	threadpool::par::inclusive_scan(v.begin(), v.end(), inc.begin());
+	threadpool::par::exclusive_scan(v.begin(), v.end(), exc.begin(), 0L);
+	std::vector<long> expected(v.size());
+	std::inclusive_scan(v.begin(), v.end(), expected.begin());
+	for (std::size_t i = 0; i < v.size(); i++) {
+		if (inc[i] != expected[i] ||
+		    exc[i] != (i == 0 ? 0 : expected[i - 1])) {
+			printf("unexpected scan result at %zu\n", i);
+			return 1;
+		}
+	}
+
+	std::vector<int> keys(200000);
+	std::mt19937 rng(42);
+	for (int &k : keys)
+		k = static_cast<int>(rng() % 1000);
+	threadpool::par::sort(keys.begin(), keys.end());
+	if (!std::is_sorted(keys.begin(), keys.end())) {
+		printf("parallel sort didn't sort\n");
+		return 1;
+	}
+	threadpool::par::sort(keys.begin(), keys.end(), std::greater<>());
+	if (!std::is_sorted(keys.begin(), keys.end(), std::greater<>())) {
+		printf("parallel sort didn't sort in reverse\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+static int nested_parallel_algorithms()
+{
+	// Every thread of the pool waits on a scan.
+	threadpool::pool pool(config(4));
+	threadpool::par::use(pool);
+	std::vector<long> in(10000, 1), out[4];
+	std::atomic<int> scanned{0};
+	for (auto &o : out) {
+		o.resize(in.size());
+		pool.submit([&in, &o, &scanned] {
+			threadpool::par::inclusive_scan(in.begin(), in.end(),
+							o.begin());
+			scanned++;
+		});
+	}
+	pool.wait_idle();
+	if (scanned != 4 || out[3].back() != 10000) {
+		printf("unexpected nested scans (%d done)\n", scanned.load());
+		return 1;
+	}
+
+	// Only thread of the pool waits on its own algorithms.
+	threadpool::pool single(config(1));
+	threadpool::par::use(single);
+	std::vector<int> v(1000, 1), w(v.size());
+	single.submit([&v, &w] {
+		threadpool::par::for_each(v.begin(), v.end(),
+					  [](int &x) { x *= 3; });
+		threadpool::par::transform(v.begin(), v.end(), w.begin(),
+					   [](int x) { return x + 1; });
+	});
+	single.wait_idle();
+	if (std::count(w.begin(), w.end(), 4) != 1000) {
+		printf("unexpected nested for_each/transform result\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+#ifdef TPOOL_COROUTINES
+static threadpool::task<int> add(threadpool::pool &pool, int a, int b)
+{
+	co_await pool.schedule();
+	if (tpool_current() != pool.native())
+		throw std::runtime_error("not resumed on pool");
+	co_return a + b;
+}
+
+static threadpool::task<void> fail(threadpool::pool &pool)
+{
+	co_await pool.schedule();
+	throw std::runtime_error("failed");
+}
+
+static threadpool::task<int> handler(threadpool::pool &pool)
+{
+	int sum = 0;
+	for (int i = 0; i < 100; i++)
+		sum += co_await add(pool, i, 1);
+
+	try {
+		co_await fail(pool);
+		sum = -1;
+	} catch (const std::runtime_error &) {
+	}
+	co_return sum;
+}
+
+static int coroutines()
+{
+	threadpool::pool pool(config(4));
+	int sum = threadpool::sync_wait(handler(pool));
+	if (sum != 5050) {
+		printf("expected sum to be 5050, got %d\n", sum);
+		return 1;
+	}
+	return 0;
+}
+
+static threadpool::task<int> sticky(threadpool::pool &pool, tpool_future &f)
+{
+	co_await pool.schedule();
+	unsigned int worker = tpool_worker_id();
+	void *v = co_await pool.when_ready(f);
+	if (v != &f || tpool_worker_id() != worker)
+		co_return 1;
+	co_return 0;
+}
+
+static int sticky_coroutines()
+{
+	threadpool::pool pool(config(4));
+	for (int i = 0; i < 10; i++) {
+		tpool_future f;
+		tpool_future_init(&f);
+		std::thread setter([&f] {
+			std::this_thread::sleep_for(
+			    std::chrono::milliseconds(10));
+			tpool_future_set(&f, &f);
+		});
+		int err = threadpool::sync_wait(sticky(pool, f));
+		setter.join();
+		if (err) {
+			printf("expected coroutine to resume on its worker\n");
+			return 1;
+		}
+	}
+	return 0;
+}
+#endif /* TPOOL_COROUTINES */
+
+class counting_resource : public std::pmr::memory_resource {
+public:
+	std::atomic<int> allocated{0}, deallocated{0};
+
+private:
+	void *do_allocate(std::size_t bytes, std::size_t alignment) override
+	{
+		allocated++;
+		return std::pmr::new_delete_resource()->allocate(bytes,
+								 alignment);
+	}
+
+	void do_deallocate(void *p, std::size_t bytes,
+			   std::size_t alignment) override
+	{
+		deallocated++;
+		std::pmr::new_delete_resource()->deallocate(p, bytes,
+							    alignment);
+	}
+
+	bool do_is_equal(const memory_resource &o) const noexcept override
+	{
+		return this == &o;
+	}
+};
+
+static int memory_resources()
+{
+	// Freed block of a size class is reused by next allocation.
+	std::pmr::memory_resource *r = threadpool::recycling_resource();
+	void *p = r->allocate(200);
+	r->deallocate(p, 200);
+	if (r->allocate(200) != p) {
+		printf("expected recycling resource to reuse freed block\n");
+		return 1;
+	}
+	r->deallocate(p, 200);
+
+	counting_resource res;
+	std::atomic<int> sum{0};
+	{
+		threadpool::pool pool(config(4));
+		for (int i = 0; i < 100; i++) {
+			std::array<int, 32> big{};
+			big[31] = i;
+			pool.submit(std::allocator_arg, &res,
+				    [&sum, big] { sum += big[31]; });
+		}
+		pool.wait_idle();
+		if (sum != 4950 || res.allocated != 100 ||
+		    res.deallocated != 100) {
+			printf("expected 100 closures allocated from resource, "
+			       "got %d (%d freed)\n",
+			       res.allocated.load(), res.deallocated.load());
+			return 1;
+		}
+
+#ifdef TPOOL_COROUTINES
+		threadpool::task<int> t = [&] {
+			threadpool::frame_resource_scope scope(&res);
+			return add(pool, 1, 2);
+		}();
+		int v = threadpool::sync_wait(std::move(t));
+		if (v != 3 || res.allocated != 101 || res.deallocated != 101) {
+			printf("expected coroutine frame allocated from "
+			       "resource\n");
+			return 1;
+		}
+#endif /* TPOOL_COROUTINES */
+	}
+	return 0;
+}
+
+#ifdef TPOOL_SENDERS
+enum class completion { none, value, value_off_pool, error, stopped };
+
+struct test_receiver {
+	tpool_future *done;
+	tpool *pool;
+	completion *result;
+
+	void set_value() && noexcept
+	{
+		*result = tpool_current() == pool ? completion::value
+						  : completion::value_off_pool;
+		tpool_future_set(done, nullptr);
+	}
+
+	void set_error(std::exception_ptr) && noexcept
+	{
+		*result = completion::error;
+		tpool_future_set(done, nullptr);
+	}
+
+	void set_stopped() && noexcept
+	{
+		*result = completion::stopped;
+		tpool_future_set(done, nullptr);
+	}
+};
+
+template <class Sender>
+static completion run_sender(threadpool::pool &pool, Sender &&sndr)
+{
+	tpool_future done;
+	completion result = completion::none;
+
+	tpool_future_init(&done);
+	auto op = std::forward<Sender>(sndr).connect(
+	    test_receiver{&done, pool.native(), &result});
+	op.start();
+	tpool_future_get(&done);
+	return result;
+}
+
+static int senders()
+{
+	threadpool::pool pool(config(4));
+	threadpool::scheduler sch = pool.get_scheduler();
+	std::array<std::atomic<int>, 1000> hits{};
+
+	if (run_sender(pool, sch.schedule()) != completion::value) {
+		printf("schedule sender didn't complete on pool\n");
+		return 1;
+	}
+
+	auto hit = [&](std::size_t i) { hits[i]++; };
+	completion c = run_sender(
+	    pool, threadpool::bulk(threadpool::bulk(sch.schedule(),
+						    std::size_t{1000}, hit),
+				   std::size_t{1000}, hit));
+	if (c != completion::value) {
+		printf("bulk sender didn't complete with a value\n");
+		return 1;
+	}
+	for (std::size_t i = 0; i < hits.size(); i++) {
+		if (hits[i] != 2) {
+			printf("expected index %zu to be hit twice, got %d\n",
+			       i, hits[i].load());
+			return 1;
+		}
+	}
+
+	c = run_sender(pool, threadpool::bulk(sch.schedule(), 100, [](int i) {
+			       if (i == 42)
+				       throw std::runtime_error("failed");
+		       }));
+	if (c != completion::error) {
+		printf("bulk sender didn't complete with an error\n");
+		return 1;
+	}
+
+	// Only thread of the pool runs iterations it waits for.
+	threadpool::pool single(config(1));
+	std::atomic<int> count{0};
+	c = run_sender(single,
+		       threadpool::bulk(single.get_scheduler().schedule(), 10,
+					[&](int) { count++; }));
+	if (c != completion::value || count != 10) {
+		printf("expected 10 bulk iterations on single thread, got "
+		       "%d\n",
+		       count.load());
+		return 1;
+	}
+	return 0;
+}
+#endif /* TPOOL_SENDERS */
+
+int main()
+{
+	printf("executing C++ tests...\n");
+	TRY(lambda_tasks);
+	TRY(move_only_tasks);
+	TRY(policy_pools);
+	TRY(task_groups);
+	TRY(memory_resources);
+	TRY(fork_join);
+	TRY(parallel_algorithms);
+	TRY(nested_parallel_algorithms);
+#ifdef TPOOL_COROUTINES
+	TRY(coroutines);
+	TRY(sticky_coroutines);
+#endif /* TPOOL_COROUTINES */
+#ifdef TPOOL_SENDERS
+	TRY(senders);
+#endif /* TPOOL_SENDERS */
+	printf("all tests are ok\n");
+	return 0;
+}
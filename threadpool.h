@@ -28,10 +28,39 @@
 #ifndef THREADPOOL_H_INCLUDE
 #define THREADPOOL_H_INCLUDE
 
+#include <errno.h>
+#include <limits.h>
 #include <pthread.h>
 #include <sched.h>
-#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif /* __linux__ */
+
+// Atomic type of public structures. C11 atomic types are layout compatible
+// with their std::atomic counterpart.
+#ifdef __cplusplus
+#include <atomic>
+#define TPOOL_ATOMIC(T) std::atomic<T>
+
+extern "C" {
+#else
+#include <stdatomic.h>
+#define TPOOL_ATOMIC(T) _Atomic(T)
+#endif /* __cplusplus */
 
 #ifndef TPOOL_DEFAULT_STACK_SIZE
 #define TPOOL_DEFAULT_STACK_SIZE (16 * 1024 * 1024)
@@ -41,6 +70,46 @@
 #define TPOOL_DEFAULT_THREADS_MAX 16
 #endif /* TPOOL_DEFAULT_THREADS_MAX */
 
+#ifndef TPOOL_BUSY_POLL_SPINS
+#define TPOOL_BUSY_POLL_SPINS 4096
+#endif /* TPOOL_BUSY_POLL_SPINS */
+
+#ifndef TPOOL_TEAM_MAX
+#define TPOOL_TEAM_MAX 64
+#endif /* TPOOL_TEAM_MAX */
+
+#ifndef TPOOL_BARRIER_SPINS
+#define TPOOL_BARRIER_SPINS 1024
+#endif /* TPOOL_BARRIER_SPINS */
+
+#ifndef TPOOL_LOOP_CHUNK_NS
+#define TPOOL_LOOP_CHUNK_NS 20000
+#endif /* TPOOL_LOOP_CHUNK_NS */
+
+#ifndef TPOOL_DEFAULT_TILE
+#define TPOOL_DEFAULT_TILE 32
+#endif /* TPOOL_DEFAULT_TILE */
+
+#ifndef TPOOL_DEFAULT_FILE_CHUNK
+#define TPOOL_DEFAULT_FILE_CHUNK (1024 * 1024)
+#endif /* TPOOL_DEFAULT_FILE_CHUNK */
+
+#ifndef TPOOL_FILE_TOKENS
+#define TPOOL_FILE_TOKENS 64
+#endif /* TPOOL_FILE_TOKENS */
+
+#ifndef TPOOL_MR_BUCKETS
+#define TPOOL_MR_BUCKETS 16
+#endif /* TPOOL_MR_BUCKETS */
+
+#ifndef TPOOL_FORK_SURPLUS
+#define TPOOL_FORK_SURPLUS 2
+#endif /* TPOOL_FORK_SURPLUS */
+
+#ifndef TPOOL_INBOX_MAX
+#define TPOOL_INBOX_MAX 64
+#endif /* TPOOL_INBOX_MAX */
+
 struct tpool_task;
 
 typedef void (*tpool_work_fn)(struct tpool_task *task);
@@ -74,35 +143,153 @@ struct tpool_batch tpool_batch_from_task(struct tpool_task *t);
  */
 void tpool_batch_push(struct tpool_batch *b, struct tpool_batch o);
 
+/**
+ * A class of tasks whose start rate is capped by a token bucket. Each task
+ * released to the pool consumes one token, tokens are refilled lazily at `rate`
+ * per second up to `burst`. Tasks scheduled while the bucket is empty are
+ * parked in the class queue until the pool refills it.
+ */
+struct tpool_rate_limit {
+	struct tpool_rate_limit *next;
+	unsigned int rate;
+	unsigned int burst;
+
+	// Pool mutex protected fields.
+	unsigned int tokens;
+	uint64_t refill_ns;
+	struct tpool_batch parked;
+	bool armed;
+};
+
+/**
+ * Initializes a rate limit allowing `rate` tasks per second with bursts of up
+ * to `burst` tasks. `rate` must not be zero, a zero `burst` is treated as 1.
+ */
+void tpool_rate_limit_init(struct tpool_rate_limit *rl, unsigned int rate,
+			   unsigned int burst);
+
 /**
  * A thread part of the pool. This is a private structure, use at your own risk.
  */
 struct tpool_thread {
-	struct tpool_thread *next;
-	pthread_t tid;
+	struct tpool *pool;
+	unsigned int id;
+	bool lane;
+};
+
+/**
+ * Kernel scheduling policy of pool's threads. TPOOL_POLICY_BATCH and
+ * TPOOL_POLICY_IDLE are Linux specific and behave as TPOOL_POLICY_OTHER
+ * elsewhere.
+ */
+enum tpool_policy {
+	TPOOL_POLICY_INHERIT = 0,
+	TPOOL_POLICY_OTHER,
+	TPOOL_POLICY_BATCH,
+	TPOOL_POLICY_IDLE,
+	TPOOL_POLICY_FIFO,
 };
 
+struct tpool;
+
+typedef void (*tpool_idle_fn)(struct tpool *t);
+
 /**
  * Thread pool configuration options.
+ *
+ * `lane_threads` workers are reserved for the latency-critical lane (see
+ * tpool_schedule_lane()) in addition to `threads_max`. Unless `lane_share` is
+ * set they never execute bulk work so a lane task waits at most for a
+ * reserved worker to finish another lane task. With `lane_share`, reserved
+ * workers take bulk work when the lane is empty and go back to the lane at
+ * the next task boundary.
+ *
+ * If `cpus_len` isn't zero, thread `i` is pinned to CPU `cpus[i % cpus_len]`
+ * (Linux only, requires _GNU_SOURCE), lane threads are numbered after bulk
+ * ones. With `busy_poll`, idle threads spin on the queues instead of
+ * sleeping and schedulers never issue a wake up. This is meant for pinned
+ * threads on isolated cores, idle threads then check for pool shutdown and
+ * rate limit refills every TPOOL_BUSY_POLL_SPINS spins.
+ *
+ * Threads are created with scheduling `policy`. `nice` applies to
+ * TPOOL_POLICY_OTHER and TPOOL_POLICY_BATCH (Linux only, requires
+ * _GNU_SOURCE) and `priority` to TPOOL_POLICY_FIFO. If the process lacks
+ * permissions for a real-time policy, threads fall back to
+ * TPOOL_POLICY_OTHER with `nice`, a nice value that can't be applied is
+ * ignored.
+ *
+ * If set, `idle_fn` is called each time the pool becomes idle, by the thread
+ * that executed the last task.
  */
 struct tpool_config {
 	size_t stack_size;
 	unsigned int threads_max;
+	unsigned int lane_threads;
+	bool lane_share;
+	const unsigned int *cpus;
+	unsigned int cpus_len;
+	bool busy_poll;
+	enum tpool_policy policy;
+	int nice;
+	int priority;
+	tpool_idle_fn idle_fn;
+};
+
+/**
+ * Local queue of a pool thread, see tpool_schedule_affine(). `idle_pos` is
+ * index of the thread in pool's idle stack, UINT_MAX if it isn't idle.
+ * `running` is set while thread executes a task and `sleeping` while it is
+ * about to wait or waiting for work. `inbox` is a lock-free stack of tasks
+ * resumed on the thread, see tpool_resume_on(), moved to `queue` by the pool
+ * mutex holder. `queued` mirrors size of `queue` for readers without the
+ * mutex. This is a private structure, use at your own risk.
+ */
+struct tpool_local {
+	struct tpool_batch queue;
+	pthread_cond_t cond;
+	unsigned int idle_pos;
+	TPOOL_ATOMIC(bool) running;
+	TPOOL_ATOMIC(bool) sleeping;
+	TPOOL_ATOMIC(uintptr_t) inbox;
+	TPOOL_ATOMIC(unsigned int) inbox_len;
+	TPOOL_ATOMIC(unsigned int) queued;
 };
 
 /**
  * Thread pool.
+ *
+ * `state` packs the number of executing tasks in its high 32 bits and the
+ * number of queued tasks, lane and local queues included, in its low 32 bits.
+ * `idle_epoch` is incremented by 2 each time state drops to zero, its low bit
+ * is set while some thread waits for it. `locals` holds one local queue per
+ * bulk thread, indexed by thread id, and is allocated along the first thread.
+ * Idle bulk threads wait on their local queue condition variable and are
+ * pushed on `idle_ids` so they can be woken up individually.
  */
 struct tpool {
 	struct tpool_config cfg;
-	atomic_uint threads_count;
-	atomic_uint threads_idle;
+	TPOOL_ATOMIC(unsigned int) threads_count;
+	TPOOL_ATOMIC(unsigned int) threads_idle;
+	TPOOL_ATOMIC(unsigned int) lane_count;
+	TPOOL_ATOMIC(unsigned int) lane_idle;
+	TPOOL_ATOMIC(unsigned long long) state;
+	TPOOL_ATOMIC(unsigned int) idle_epoch;
+	TPOOL_ATOMIC(unsigned int) lane_queued;
+	TPOOL_ATOMIC(bool) paused;
 
 	// Mutex protected fields.
 	pthread_mutex_t mu;
 	struct tpool_batch work_queue;
+	struct tpool_batch lane_queue;
+	struct tpool_local *locals;
+	unsigned int *idle_ids;
+	unsigned int idle_len;
+	unsigned int local_queued;
+	struct tpool_rate_limit *limits;
+	uint64_t timer_ns;
 	bool done;
-	pthread_cond_t cond;
+	pthread_cond_t lane_cond;
+	pthread_cond_t quiesce_cond;
 };
 
 /**
@@ -112,10 +299,148 @@ void tpool_init(struct tpool *t, struct tpool_config cfg);
 
 /**
  * Deinitializes a thread pool and clean up all threads. This function blocks
- * until all executing tasks are done.
+ * until all executing tasks are done. Rate limited tasks that are still parked
+ * are run at their class rate before threads exit.
  */
 void tpool_deinit(struct tpool *t);
 
+/**
+ * Pauses a thread pool. This function blocks until executing tasks are done,
+ * threads then park without dequeuing tasks. Tasks can still be scheduled,
+ * they're kept queued until tpool_resume() is called. Until then, executing
+ * tasks waiting in tpool_join_wait() keep executing queued tasks and members
+ * of started teams still start, so executing tasks can be done. This function
+ * must not be called from a task.
+ */
+void tpool_pause(struct tpool *t);
+
+/**
+ * Resumes a paused thread pool. tpool_deinit() resumes pool implicitly.
+ */
+void tpool_resume(struct tpool *t);
+
+/**
+ * Blocks until thread pool is idle, that is no task is queued nor executing.
+ * Tasks parked by a rate limit aren't considered. Returns immediately if pool
+ * is idle.
+ */
+void tpool_wait_idle(struct tpool *t);
+
+/**
+ * Returns pool of calling thread, or NULL if it isn't a pool thread.
+ */
+struct tpool *tpool_current(void);
+
+/**
+ * Returns id of calling thread in its pool, or UINT_MAX if it isn't a pool
+ * thread. Bulk threads ids are below `threads_max`.
+ */
+unsigned int tpool_worker_id(void);
+
+struct tpool_team;
+
+/**
+ * A member of a team. `id` ranges from 0 to team size excluded, member 0 is
+ * the thread that started the team. `base` is the position of the member's
+ * next dynamic loop on team's cursor.
+ */
+struct tpool_team_member {
+	struct tpool_task task;
+	struct tpool_team *team;
+	unsigned int id;
+	size_t base;
+};
+
+typedef void (*tpool_team_fn)(struct tpool_team_member *m, void *ctx);
+
+/**
+ * A team of pool threads executing the same function in SPMD style. Members
+ * synchronize with tpool_team_barrier() which spins for TPOOL_BARRIER_SPINS
+ * iterations before blocking, so iterative workloads pay a barrier instead of
+ * a schedule and wake up per iteration.
+ */
+struct tpool_team {
+	unsigned int size;
+	tpool_team_fn fn;
+	void *ctx;
+	TPOOL_ATOMIC(unsigned int) arrived;
+	TPOOL_ATOMIC(unsigned int) generation;
+	TPOOL_ATOMIC(unsigned int) running;
+	TPOOL_ATOMIC(size_t) cursor;
+	struct tpool_team_member members[TPOOL_TEAM_MAX];
+};
+
+/**
+ * Runs `fn` on a team of `size` members and blocks until all members
+ * returned. Calling thread acts as member 0, other members are scheduled on
+ * local queues of threads 0 to `size` - 2, calling thread excluded, so
+ * repeated teams keep their members on the same threads. `size` is clamped to
+ * TPOOL_TEAM_MAX and `threads_max`, plus one if calling thread isn't a bulk
+ * thread of the pool. Members block in barriers, so a team started on a
+ * thread of the pool, from a task or a team function, only runs members on
+ * threads which are idle or not spawned yet and may be smaller than `size`.
+ * Returns team size or negative error code of tpool_schedule(), in which case
+ * team still runs on already spawned threads.
+ */
+int tpool_team_run(struct tpool *t, struct tpool_team *team, unsigned int size,
+		   tpool_team_fn fn, void *ctx);
+
+/**
+ * Blocks until all members of the team reached the barrier.
+ */
+void tpool_team_barrier(struct tpool_team_member *m);
+
+typedef void (*tpool_range_fn)(void *ctx, size_t begin, size_t end);
+
+/**
+ * Iterations distribution of parallel loops.
+ *
+ * TPOOL_LOOP_STATIC splits the range in one contiguous block per member,
+ * TPOOL_LOOP_CYCLIC deals blocks of `chunk` iterations to members round-robin.
+ * Both map iterations to members deterministically.
+ *
+ * Other schedules are dynamic, members claim chunks from a shared atomic
+ * cursor. TPOOL_LOOP_GUIDED chunks shrink with remaining iterations, down to
+ * `chunk`. TPOOL_LOOP_ADAPTIVE measures per iteration cost of each member
+ * online and sizes chunks to last about TPOOL_LOOP_CHUNK_NS, starting with
+ * `chunk` iterations.
+ */
+enum tpool_loop_schedule {
+	TPOOL_LOOP_STATIC = 0,
+	TPOOL_LOOP_CYCLIC,
+	TPOOL_LOOP_GUIDED,
+	TPOOL_LOOP_ADAPTIVE,
+};
+
+/**
+ * Parallel loop options. Loops end with a team barrier unless `nowait` is
+ * set, any loop may follow a `nowait` loop.
+ */
+struct tpool_loop {
+	enum tpool_loop_schedule schedule;
+	size_t chunk;
+	bool nowait;
+};
+
+/**
+ * Shares iterations in range [begin, end) among team members according to
+ * `loop` and calls `fn` on each member's sub ranges. All members of the team
+ * must call this function with the same arguments. Members execute on the
+ * same thread for the whole team function, so repeated loops over the same
+ * data with a deterministic schedule hit the same caches.
+ */
+void tpool_team_for(struct tpool_team_member *m, size_t begin, size_t end,
+		    struct tpool_loop loop, tpool_range_fn fn, void *ctx);
+
+/**
+ * Runs a parallel loop over range [begin, end) on a team of `workers` members
+ * (threads_max + 1 if zero) and blocks until it's done. Errors are reported
+ * as in tpool_team_run().
+ */
+int tpool_parallel_for(struct tpool *t, size_t begin, size_t end,
+		       unsigned int workers, struct tpool_loop loop,
+		       tpool_range_fn fn, void *ctx);
+
 /**
  * Schedules a batch of task on the thread pool. If there is no idle thread and
  * thread limit isn't reached a new thread is spawned. In case of failure,
@@ -123,145 +448,2824 @@ void tpool_deinit(struct tpool *t);
  */
 int tpool_schedule(struct tpool *t, struct tpool_batch b);
 
-#ifdef THREADPOOL_IMPLEMENTATION
+/**
+ * Schedules a batch of task on the latency-critical lane. Lane tasks are
+ * executed before any bulk task by all threads, and are the only tasks
+ * executed by threads reserved with `lane_threads`. Errors are reported as in
+ * tpool_schedule().
+ */
+int tpool_schedule_lane(struct tpool *t, struct tpool_batch b);
 
-struct tpool_batch tpool_batch_from_task(struct tpool_task *t)
-{
-	struct tpool_batch b;
-	b.size = 1;
-	b.head = t;
-	b.tail = t;
-	return b;
-}
+/**
+ * Schedules a batch of task subject to the given rate limit. Tasks are started
+ * in order, tasks exceeding the available tokens are parked and released by
+ * the pool's timer once tokens are refilled. A rate limit must only be used
+ * with a single pool. Errors are reported as in tpool_schedule().
+ */
+int tpool_schedule_limited(struct tpool *t, struct tpool_rate_limit *rl,
+			   struct tpool_batch b);
 
-void tpool_batch_push(struct tpool_batch *b, struct tpool_batch o)
-{
-	if (o.size == 0)
-		return;
-	if (b->size == 0)
-		*b = o;
-	else {
-		b->tail->next = o.head;
-		b->tail = o.tail;
-		b->size += o.size;
-	}
-}
+/**
+ * Schedules a batch of task on the local queue of the thread `key` maps to.
+ * Tasks sharing a key, e.g. a hash of a connection or a data address, tend to
+ * run on the same thread and find their data in its caches. That thread is
+ * woken up if it's idle, otherwise another thread is, and threads steal from
+ * local queues of others once they run out of work. Errors are reported as in
+ * tpool_schedule().
+ */
+int tpool_schedule_affine(struct tpool *t, uint64_t key, struct tpool_batch b);
 
-static struct tpool_task *tpool_batch_pop(struct tpool_batch *b)
-{
-	if (b->size == 0)
-		return NULL;
-	struct tpool_task *t = b->head;
-	b->head = b->head->next;
-	if (b->tail == t)
-		b->tail = b->head = NULL;
-	b->size--;
-	return t;
-}
+/**
+ * Schedules a continuation on bulk thread `worker`, as returned by
+ * tpool_worker_id() on a thread of the pool, so state of the suspended work
+ * is still in that thread's caches when it resumes. Task is pushed on the
+ * thread's lock-free inbox, the pool mutex is only taken to wake the thread
+ * up if it sleeps, or other threads which may steal the task if it is busy.
+ * Task is scheduled as in tpool_schedule() if `worker` isn't a bulk thread, no
+ * thread was spawned yet or its inbox holds TPOOL_INBOX_MAX tasks or more.
+ * Errors are reported as in tpool_schedule().
+ */
+int tpool_resume_on(struct tpool *t, unsigned int worker,
+		    struct tpool_task *task);
 
-void tpool_init(struct tpool *t, struct tpool_config cfg)
-{
-	cfg.threads_max =
-	    cfg.threads_max == 0 ? TPOOL_DEFAULT_THREADS_MAX : cfg.threads_max;
-	cfg.stack_size =
-	    cfg.stack_size == 0 ? TPOOL_DEFAULT_STACK_SIZE : cfg.stack_size;
-	t->cfg = cfg;
-	t->threads_count = 0;
-	t->threads_idle = 0;
-	pthread_mutex_init(&t->mu, NULL);
-	t->work_queue = (struct tpool_batch){0};
-	t->done = false;
-	pthread_cond_init(&t->cond, NULL);
-}
+/**
+ * Fork/join counter. Tasks forked with tpool_fork() must call
+ * tpool_join_done() when they're done. A thread waiting with
+ * tpool_join_wait() executes queued tasks until counter drops to zero, so
+ * forked tasks may reference the waiter's stack and always complete, even if
+ * no pool thread is available.
+ */
+struct tpool_join {
+	TPOOL_ATOMIC(unsigned int) pending;
+};
 
-void tpool_deinit(struct tpool *t)
-{
-	pthread_mutex_lock(&t->mu);
-	t->done = true;
-	pthread_mutex_unlock(&t->mu);
+/**
+ * Initializes a fork/join counter.
+ */
+void tpool_join_init(struct tpool_join *j);
 
-	pthread_cond_broadcast(&t->cond);
+/**
+ * Adds a task to fork/join counter and schedules it. A task forked by a bulk
+ * thread of the pool is queued on the thread's local queue, where idle threads
+ * steal it from. Errors are reported as in tpool_schedule(), task is queued
+ * anyway.
+ */
+int tpool_fork(struct tpool *t, struct tpool_join *j, struct tpool_task *task);
 
-	while (atomic_load(&t->threads_count) > 0)
-		sched_yield();
+/**
+ * Marks a forked task as done. Counter may be freed as soon as this function
+ * is called.
+ */
+void tpool_join_done(struct tpool_join *j);
 
-	pthread_cond_destroy(&t->cond);
-}
+/**
+ * Executes queued tasks until all forked tasks are done, blocks if there is
+ * nothing to execute.
+ */
+void tpool_join_wait(struct tpool *t, struct tpool_join *j);
 
 /**
- * Main function of thread part of the thread pool.
+ * Returns whether a recursive algorithm should fork rather than solve its
+ * problem sequentially. Forking pays off as long as queued tasks don't exceed
+ * what idle and not yet spawned threads can pick up by more than
+ * TPOOL_FORK_SURPLUS tasks, beyond that busy threads have enough work and
+ * forking only adds overhead. On a bulk thread of the pool, queued tasks are
+ * those of the thread's local queue, which its forks go to, otherwise all
+ * queued tasks of the pool.
  */
-static void *tpool_thread_main(void *ptr)
-{
-	struct tpool *t = ptr;
+bool tpool_want_fork(struct tpool *t);
 
-	while (1) {
-		pthread_mutex_lock(&t->mu);
-		if (t->work_queue.size == 0) {
-			if (t->done) {
-				atomic_fetch_sub(&t->threads_count, 1);
-				pthread_mutex_unlock(&t->mu);
-				return NULL;
-			}
-			atomic_fetch_add(&t->threads_idle, 1);
-			pthread_cond_wait(&t->cond, &t->mu);
-			atomic_fetch_sub(&t->threads_idle, 1);
-		}
+typedef void (*tpool_invoke_fn)(void *ctx);
 
-		struct tpool_task *task = tpool_batch_pop(&t->work_queue);
-		pthread_mutex_unlock(&t->mu);
+/**
+ * A function and its argument, see tpool_parallel_invoke().
+ */
+struct tpool_invoke {
+	tpool_invoke_fn fn;
+	void *ctx;
+};
 
-		if (task != NULL)
-			(*task->work)(task);
-	}
-}
+/**
+ * Completion state shared by a group of functions started with
+ * tpool_when_all() or tpool_when_any(). Functions may poll
+ * tpool_when_cancelled() through their argument to stop early.
+ */
+struct tpool_when {
+	struct tpool *pool;
+	const struct tpool_invoke *fns;
+	TPOOL_ATOMIC(bool) cancelled;
+	TPOOL_ATOMIC(size_t) first;
+	bool any;
+};
 
-int tpool_schedule(struct tpool *t, struct tpool_batch b)
-{
-	pthread_attr_t attr;
-	pthread_t thread;
-	int err;
+/**
+ * Runs `fns_len` functions in parallel and blocks until all returned. Functions
+ * are forked by recursive halving, calling thread executes one of them and
+ * helps executing other tasks while waiting.
+ */
+void tpool_parallel_invoke(struct tpool *t, const struct tpool_invoke *fns,
+			   size_t fns_len);
 
-	if (b.size == 0)
-		return 0;
+/**
+ * Variadic tpool_parallel_invoke(), arguments are struct tpool_invoke
+ * initializers: TPOOL_PARALLEL_INVOKE(t, {fn1, ctx1}, {fn2, ctx2}).
+ */
+#define TPOOL_PARALLEL_INVOKE(t, ...)                                          \
+	tpool_parallel_invoke(                                                 \
+	    (t), (struct tpool_invoke[]){__VA_ARGS__},                         \
+	    sizeof((struct tpool_invoke[]){__VA_ARGS__}) /                     \
+		sizeof(struct tpool_invoke))
 
-	// Push work.
-	pthread_mutex_lock(&t->mu);
-	tpool_batch_push(&t->work_queue, b);
-	pthread_mutex_unlock(&t->mu);
+/**
+ * Runs functions as tpool_parallel_invoke() does, functions not started yet
+ * are skipped once group is cancelled with tpool_when_cancel().
+ */
+void tpool_when_all(struct tpool *t, struct tpool_when *w,
+		    const struct tpool_invoke *fns, size_t fns_len);
 
-	// Spawn new thread if possible and needed.
-	unsigned int idle = atomic_load(&t->threads_idle);
-	if (idle == 0 && atomic_load(&t->threads_count) < t->cfg.threads_max) {
-		err = pthread_attr_init(&attr);
-		if (err)
-			goto attr_error;
+/**
+ * Runs functions as tpool_when_all() does and cancels the group as soon as
+ * the first one returns. Blocks until all started functions returned and
+ * returns index of the first one, or SIZE_MAX if none ran.
+ */
+size_t tpool_when_any(struct tpool *t, struct tpool_when *w,
+		      const struct tpool_invoke *fns, size_t fns_len);
 
-		pthread_attr_setstacksize(&attr, t->cfg.stack_size);
+/**
+ * Cancels a group, functions not started yet won't be.
+ */
+void tpool_when_cancel(struct tpool_when *w);
 
-		err = pthread_create(&thread, &attr, &tpool_thread_main, t);
-		if (err)
-			goto create_error;
+/**
+ * Returns whether group was cancelled.
+ */
+bool tpool_when_cancelled(struct tpool_when *w);
 
-		pthread_detach(thread);
+/**
+ * Result of a task, meant to be embedded in the task's own structure.
+ * Completion is signaled through an atomic state word so setting and reading
+ * a ready future never block nor allocate. Other fields than `value` are
+ * private.
+ */
+struct tpool_future {
+	void *value;
+	TPOOL_ATOMIC(unsigned int) state;
+	struct tpool *pool;
+	struct tpool_task *continuation;
+	unsigned int worker;
+};
 
-		pthread_attr_destroy(&attr);
+/**
+ * Initializes a pending future.
+ */
+void tpool_future_init(struct tpool_future *f);
 
-		atomic_fetch_add(&t->threads_count, 1);
-		idle++;
-	}
+/**
+ * Completes future with `value`, wakes up threads blocked in
+ * tpool_future_get() and schedules its continuation if any. A future must be
+ * set once. Errors of scheduling the continuation are reported as in
+ * tpool_schedule().
+ */
+int tpool_future_set(struct tpool_future *f, void *value);
 
-	// Wake up idle thread.
-	if (idle > 0) {
-		pthread_cond_signal(&t->cond);
-	}
+/**
+ * Returns whether future is completed.
+ */
+bool tpool_future_ready(struct tpool_future *f);
 
-	return 0;
+/**
+ * Blocks until future is completed and returns its value.
+ */
+void *tpool_future_get(struct tpool_future *f);
 
-create_error:
-	pthread_attr_destroy(&attr);
-attr_error:
-	return -err;
+/**
+ * Schedules `task` on pool once future is completed, immediately if it is
+ * already. Continuations registered by a thread of the pool are resumed on
+ * that thread, see tpool_resume_on(). A future has at most one continuation.
+ * Errors are reported as in tpool_schedule().
+ */
+int tpool_future_then(struct tpool *t, struct tpool_future *f,
+		      struct tpool_task *task);
+
+/**
+ * A box of iterations, [begin, end) along each dimension.
+ */
+struct tpool_box {
+	size_t begin[3];
+	size_t end[3];
+};
+
+typedef void (*tpool_box_fn)(void *ctx, const struct tpool_box *box);
+
+/**
+ * Order in which tiles are distributed. TPOOL_TILE_SPLIT recursively splits
+ * the box along its longest dimension, TPOOL_TILE_MORTON and
+ * TPOOL_TILE_HILBERT recursively split the box in quadrants (octants in 3D)
+ * following Z-order or Hilbert curve, so neighboring tiles are executed close
+ * in time. Hilbert order is only available in 2D, 3D loops use Morton order
+ * instead.
+ */
+enum tpool_tile_order {
+	TPOOL_TILE_SPLIT = 0,
+	TPOOL_TILE_MORTON,
+	TPOOL_TILE_HILBERT,
+};
+
+/**
+ * Tiling options of multidimensional loops. A zero tile size defaults to
+ * TPOOL_DEFAULT_TILE.
+ */
+struct tpool_tiling {
+	size_t tile[3];
+	enum tpool_tile_order order;
+};
+
+/**
+ * Runs a 2D parallel loop over the first two dimensions of `box`, calling `fn`
+ * on each tile. Tiles are forked and joined recursively, calling thread helps
+ * executing them until the loop is done.
+ */
+void tpool_parallel_for_2d(struct tpool *t, struct tpool_box box,
+			   struct tpool_tiling tiling, tpool_box_fn fn,
+			   void *ctx);
+
+/**
+ * Runs a 3D parallel loop over `box`, see tpool_parallel_for_2d().
+ */
+void tpool_parallel_for_3d(struct tpool *t, struct tpool_box box,
+			   struct tpool_tiling tiling, tpool_box_fn fn,
+			   void *ctx);
+
+struct tpool_pipeline;
+
+/**
+ * A token carries an item through pipeline stages. At most one item per token
+ * is in flight so number of tokens bounds memory used by a pipeline. `id`
+ * ranges from 0 to number of tokens excluded and can be used to index per
+ * token item storage, `ticket` is the input order of current item.
+ */
+struct tpool_pipeline_token {
+	struct tpool_task task;
+	struct tpool_pipeline *pipeline;
+	struct tpool_pipeline_token *next;
+	unsigned int id;
+	unsigned int stage;
+	unsigned long ticket;
+	bool owner;
+	void *item;
+};
+
+/**
+ * Stage function. First stage of a pipeline is its input, it sets token's item
+ * and returns false once input is exhausted. Return value of other stages is
+ * ignored.
+ */
+typedef bool (*tpool_stage_fn)(void *ctx, struct tpool_pipeline_token *tok);
+
+/**
+ * Parallel stages process any number of items concurrently, serial stages
+ * process one item at a time in input order. First stage is always serial.
+ */
+enum tpool_stage_mode {
+	TPOOL_STAGE_PARALLEL = 0,
+	TPOOL_STAGE_SERIAL,
+};
+
+/**
+ * A pipeline stage. Other fields than `mode`, `fn` and `ctx` are private.
+ */
+struct tpool_pipeline_stage {
+	enum tpool_stage_mode mode;
+	tpool_stage_fn fn;
+	void *ctx;
+
+	// Serial stages mutex protected fields. Tokens that can't enter stage
+	// yet are parked, sorted by ticket.
+	pthread_mutex_t mu;
+	unsigned long next;
+	bool busy;
+	struct tpool_pipeline_token *parked;
+};
+
+/**
+ * A pipeline. This is a private structure, use tpool_pipeline_run().
+ */
+struct tpool_pipeline {
+	struct tpool *pool;
+	struct tpool_pipeline_stage *stages;
+	unsigned int stages_len;
+	struct tpool_join join;
+	bool eof;
+};
+
+/**
+ * Runs items produced by first stage through all stages, with `tokens_len`
+ * items in flight at most, and blocks until input is exhausted and all items
+ * went through. Items are handed over between stages without locking except
+ * for serial stages ordering, calling thread helps executing stages.
+ */
+void tpool_pipeline_run(struct tpool *t, struct tpool_pipeline_stage *stages,
+			unsigned int stages_len,
+			struct tpool_pipeline_token *tokens,
+			unsigned int tokens_len);
+
+/**
+ * A chunk of file made of whole records. `index` is the chunk number in file
+ * order and `slot`, lower than TPOOL_FILE_TOKENS, identifies chunks in
+ * flight: a chunk is merged before its slot is reused.
+ */
+struct tpool_file_chunk {
+	const char *data;
+	size_t len;
+	size_t offset;
+	unsigned long index;
+	unsigned int slot;
+};
+
+typedef void (*tpool_chunk_fn)(void *ctx, const struct tpool_file_chunk *c);
+
+/**
+ * File scan options. File is split in chunks of about `chunk_size` bytes
+ * (TPOOL_DEFAULT_FILE_CHUNK if zero) extended up to the next `delimiter`, or
+ * newline if zero. Chunks are passed to `process` in parallel, then to `merge`
+ * in file order if set.
+ */
+struct tpool_file_config {
+	size_t chunk_size;
+	char delimiter;
+	tpool_chunk_fn process;
+	tpool_chunk_fn merge;
+	void *ctx;
+};
+
+/**
+ * Maps file at `path` in memory and processes it chunk by chunk on the pool
+ * using a pipeline, blocking until whole file is processed. Returns 0 or a
+ * negative errno if file can't be opened or mapped.
+ */
+int tpool_file_scan(struct tpool *t, const char *path,
+		    struct tpool_file_config scan);
+
+/**
+ * Intrusive key/value entry of a MapReduce, embed it in your own structure.
+ * `hash` must be set before entry is emitted.
+ */
+struct tpool_mr_entry {
+	struct tpool_mr_entry *next;
+	uint64_t hash;
+};
+
+/**
+ * Per member emission target of a MapReduce. This is a private structure, use
+ * tpool_mr_emit().
+ */
+struct tpool_mr_shard;
+
+typedef void (*tpool_mr_map_fn)(void *ctx, struct tpool_mr_shard *s,
+				size_t begin, size_t end);
+
+typedef bool (*tpool_mr_eq_fn)(void *ctx, const struct tpool_mr_entry *a,
+			       const struct tpool_mr_entry *b);
+
+/**
+ * Folds `src` into `dst`, both having the same key. `src` is dropped by the
+ * MapReduce and may be freed.
+ */
+typedef void (*tpool_mr_combine_fn)(void *ctx, struct tpool_mr_entry *dst,
+				    struct tpool_mr_entry *src);
+
+/**
+ * Receives final entry of a key, entry is dropped by the MapReduce and may be
+ * freed.
+ */
+typedef void (*tpool_mr_reduce_fn)(void *ctx, struct tpool_mr_entry *e);
+
+/**
+ * MapReduce options. `map` is called on sub ranges of input distributed
+ * according to `loop` and emits entries with tpool_mr_emit(). Entries are
+ * hashed in `partitions` partitions (twice the team size if zero), partition
+ * i of all members is merged by a single member using `eq` and `combine`,
+ * then `reduce` is called once per distinct key. Reduce calls of different
+ * partitions run in parallel.
+ */
+struct tpool_mr_config {
+	unsigned int workers;
+	unsigned int partitions;
+	struct tpool_loop loop;
+	tpool_mr_map_fn map;
+	tpool_mr_eq_fn eq;
+	tpool_mr_combine_fn combine;
+	tpool_mr_reduce_fn reduce;
+	void *ctx;
+};
+
+/**
+ * Emits an entry from a map function. Entry is inserted in calling member's
+ * own hash table without locking, or combined with the entry of the same key
+ * already there.
+ */
+void tpool_mr_emit(struct tpool_mr_shard *s, struct tpool_mr_entry *e);
+
+/**
+ * Runs a MapReduce over range [begin, end) on a team of `workers` members
+ * (threads_max + 1 if zero) and blocks until all keys are reduced. Returns 0,
+ * -ENOMEM if hash tables can't be allocated or an error of tpool_team_run().
+ */
+int tpool_mapreduce(struct tpool *t, size_t begin, size_t end,
+		    struct tpool_mr_config mr);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#ifdef THREADPOOL_IMPLEMENTATION
+
+#ifdef __cplusplus
+#error "threadpool.h implementation must be compiled as C11"
+#endif /* __cplusplus */
+
+#define TPOOL_NSEC_PER_SEC UINT64_C(1000000000)
+
+#define TPOOL_STATE_ACTIVE (1ULL << 32)
+#define TPOOL_STATE_QUEUED_MASK (TPOOL_STATE_ACTIVE - 1)
+
+#define TPOOL_FUTURE_WAITERS 1u
+#define TPOOL_FUTURE_CONTINUATION 2u
+#define TPOOL_FUTURE_READY 4u
+
+/**
+ * Pool and thread structure of current thread.
+ */
+static _Thread_local struct tpool *tpool_self;
+static _Thread_local struct tpool_thread *tpool_self_thread;
+
+#if defined(__linux__) && defined(_GNU_SOURCE)
+
+/**
+ * Blocks until woken up if `*addr` is equal to `val`. May return spuriously.
+ */
+static void tpool_futex_wait(atomic_uint *addr, unsigned int val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+/**
+ * Wakes up to `n` threads blocked on `addr`. `addr` may be freed memory.
+ */
+static void tpool_futex_wake(atomic_uint *addr, int n)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+#else
+
+/**
+ * Parking lot used to emulate futexes where they aren't available. Addresses
+ * are hashed to a bucket, waking up a bucket wakes up all its waiters.
+ */
+#define TPOOL_PARKING_BUCKET_INIT                                              \
+	{PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER}
+
+static struct tpool_parking_bucket {
+	pthread_mutex_t mu;
+	pthread_cond_t cond;
+} tpool_parking_lot[8] = {
+    TPOOL_PARKING_BUCKET_INIT, TPOOL_PARKING_BUCKET_INIT,
+    TPOOL_PARKING_BUCKET_INIT, TPOOL_PARKING_BUCKET_INIT,
+    TPOOL_PARKING_BUCKET_INIT, TPOOL_PARKING_BUCKET_INIT,
+    TPOOL_PARKING_BUCKET_INIT, TPOOL_PARKING_BUCKET_INIT,
+};
+
+static struct tpool_parking_bucket *tpool_parking_bucket(atomic_uint *addr)
+{
+	uintptr_t h = (uintptr_t)addr;
+	h ^= h >> 7;
+	return &tpool_parking_lot[(h >> 2) % 8];
+}
+
+static void tpool_futex_wait(atomic_uint *addr, unsigned int val)
+{
+	struct tpool_parking_bucket *b = tpool_parking_bucket(addr);
+	pthread_mutex_lock(&b->mu);
+	if (atomic_load(addr) == val)
+		pthread_cond_wait(&b->cond, &b->mu);
+	pthread_mutex_unlock(&b->mu);
+}
+
+static void tpool_futex_wake(atomic_uint *addr, int n)
+{
+	struct tpool_parking_bucket *b = tpool_parking_bucket(addr);
+	(void)n;
+	pthread_mutex_lock(&b->mu);
+	pthread_cond_broadcast(&b->cond);
+	pthread_mutex_unlock(&b->mu);
+}
+
+#endif
+
+/**
+ * Hints the CPU that we're in a spin-wait loop.
+ */
+static inline void tpool_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static uint64_t tpool_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * TPOOL_NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Waits on condition variable until it is signaled or monotonic clock reaches
+ * `deadline_ns`.
+ */
+static void tpool_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mu,
+				 uint64_t deadline_ns)
+{
+	struct timespec ts;
+#ifdef __APPLE__
+	uint64_t now = tpool_now_ns();
+	if (deadline_ns <= now)
+		return;
+	ts.tv_sec = (time_t)((deadline_ns - now) / TPOOL_NSEC_PER_SEC);
+	ts.tv_nsec = (long)((deadline_ns - now) % TPOOL_NSEC_PER_SEC);
+	pthread_cond_timedwait_relative_np(cond, mu, &ts);
+#else
+	ts.tv_sec = (time_t)(deadline_ns / TPOOL_NSEC_PER_SEC);
+	ts.tv_nsec = (long)(deadline_ns % TPOOL_NSEC_PER_SEC);
+	pthread_cond_timedwait(cond, mu, &ts);
+#endif
+}
+
+/**
+ * Initializes a condition variable whose timed waits use CLOCK_MONOTONIC
+ * deadlines, see tpool_cond_timedwait().
+ */
+static void tpool_cond_init(pthread_cond_t *cond)
+{
+#ifdef __APPLE__
+	pthread_cond_init(cond, NULL);
+#else
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+#endif
+}
+
+struct tpool_batch tpool_batch_from_task(struct tpool_task *t)
+{
+	struct tpool_batch b;
+	b.size = 1;
+	b.head = t;
+	b.tail = t;
+	return b;
+}
+
+void tpool_batch_push(struct tpool_batch *b, struct tpool_batch o)
+{
+	if (o.size == 0)
+		return;
+	if (b->size == 0)
+		*b = o;
+	else {
+		b->tail->next = o.head;
+		b->tail = o.tail;
+		b->size += o.size;
+	}
+}
+
+static struct tpool_task *tpool_batch_pop(struct tpool_batch *b)
+{
+	if (b->size == 0)
+		return NULL;
+	struct tpool_task *t = b->head;
+	b->head = b->head->next;
+	if (b->tail == t)
+		b->tail = b->head = NULL;
+	b->size--;
+	return t;
+}
+
+void tpool_rate_limit_init(struct tpool_rate_limit *rl, unsigned int rate,
+			   unsigned int burst)
+{
+	rl->next = NULL;
+	rl->rate = rate;
+	rl->burst = burst == 0 ? 1 : burst;
+	rl->tokens = rl->burst;
+	rl->refill_ns = tpool_now_ns();
+	rl->parked = (struct tpool_batch){0};
+	rl->armed = false;
+}
+
+/**
+ * Refills token bucket according to time elapsed since last refill.
+ */
+static void tpool_rate_limit_refill(struct tpool_rate_limit *rl, uint64_t now)
+{
+	if (rl->tokens >= rl->burst || now <= rl->refill_ns) {
+		rl->refill_ns = now > rl->refill_ns ? now : rl->refill_ns;
+		return;
+	}
+
+	uint64_t elapsed = now - rl->refill_ns;
+	uint64_t missing = rl->burst - rl->tokens;
+	if (elapsed >= missing * TPOOL_NSEC_PER_SEC / rl->rate) {
+		rl->tokens = rl->burst;
+		rl->refill_ns = now;
+		return;
+	}
+
+	uint64_t n = elapsed * rl->rate / TPOOL_NSEC_PER_SEC;
+	rl->tokens += (unsigned int)n;
+	rl->refill_ns += n * TPOOL_NSEC_PER_SEC / rl->rate;
+}
+
+/**
+ * Moves parked tasks of rate limit to pool's work queue while tokens are
+ * available. Returns number of released tasks and sets `deadline` to monotonic
+ * time at which next token is available or 0 if rate limit has no more parked
+ * tasks. Pool mutex must be held.
+ */
+static unsigned int tpool_rate_limit_release(struct tpool *t,
+					     struct tpool_rate_limit *rl,
+					     uint64_t now, uint64_t *deadline)
+{
+	unsigned int released = 0;
+
+	tpool_rate_limit_refill(rl, now);
+	while (rl->tokens > 0 && rl->parked.size > 0) {
+		struct tpool_task *task = tpool_batch_pop(&rl->parked);
+		tpool_batch_push(&t->work_queue, tpool_batch_from_task(task));
+		atomic_fetch_add_explicit(&t->state, 1, memory_order_relaxed);
+		rl->tokens--;
+		released++;
+	}
+
+	*deadline = 0;
+	if (rl->parked.size > 0)
+		*deadline = rl->refill_ns +
+			    (TPOOL_NSEC_PER_SEC + rl->rate - 1) / rl->rate;
+	return released;
+}
+
+/**
+ * Releases parked tasks of all rate limits whose buckets were refilled and
+ * rearms pool's timer. Returns number of released tasks. Pool mutex must be
+ * held.
+ */
+static unsigned int tpool_timers_fire(struct tpool *t)
+{
+	uint64_t now = tpool_now_ns();
+	if (now < t->timer_ns)
+		return 0;
+
+	struct tpool_rate_limit **prev = &t->limits;
+	unsigned int released = 0;
+	uint64_t deadline;
+	t->timer_ns = UINT64_MAX;
+	while (*prev != NULL) {
+		struct tpool_rate_limit *rl = *prev;
+		released += tpool_rate_limit_release(t, rl, now, &deadline);
+		if (deadline == 0) {
+			*prev = rl->next;
+			rl->next = NULL;
+			rl->armed = false;
+			continue;
+		}
+
+		if (deadline < t->timer_ns)
+			t->timer_ns = deadline;
+		prev = &rl->next;
+	}
+	return released;
+}
+
+/**
+ * Allocates local queues of bulk threads. Pool mutex must be held.
+ */
+static int tpool_locals_init(struct tpool *t)
+{
+	unsigned int n = t->cfg.threads_max;
+	struct tpool_local *locals = calloc(n, sizeof(*locals));
+	unsigned int *idle_ids = calloc(n, sizeof(*idle_ids));
+	if (locals == NULL || idle_ids == NULL) {
+		free(locals);
+		free(idle_ids);
+		return -ENOMEM;
+	}
+
+	for (unsigned int i = 0; i < n; i++) {
+		tpool_cond_init(&locals[i].cond);
+		locals[i].idle_pos = UINT_MAX;
+		locals[i].running = false;
+		locals[i].sleeping = false;
+		locals[i].inbox = 0;
+		locals[i].inbox_len = 0;
+	}
+	t->locals = locals;
+	t->idle_ids = idle_ids;
+	return 0;
+}
+
+/**
+ * Pushes bulk thread `id` on idle stack. Pool mutex must be held.
+ */
+static void tpool_idle_push(struct tpool *t, unsigned int id)
+{
+	t->locals[id].idle_pos = t->idle_len;
+	t->idle_ids[t->idle_len++] = id;
+}
+
+/**
+ * Removes bulk thread `id` from idle stack, if it's there. Pool mutex must be
+ * held.
+ */
+static void tpool_idle_remove(struct tpool *t, unsigned int id)
+{
+	unsigned int pos = t->locals[id].idle_pos;
+	if (pos == UINT_MAX)
+		return;
+
+	unsigned int last = t->idle_ids[--t->idle_len];
+	t->idle_ids[pos] = last;
+	t->locals[last].idle_pos = pos;
+	t->locals[id].idle_pos = UINT_MAX;
+}
+
+/**
+ * Wakes up to `n` threads of idle stack, most recently idle first. Returns
+ * number of woken threads. Pool mutex must be held.
+ */
+static unsigned int tpool_wake_idle(struct tpool *t, unsigned int n)
+{
+	unsigned int woken = 0;
+	while (woken < n && t->idle_len > 0) {
+		unsigned int id = t->idle_ids[t->idle_len - 1];
+		tpool_idle_remove(t, id);
+		pthread_cond_signal(&t->locals[id].cond);
+		woken++;
+	}
+	return woken;
+}
+
+void tpool_init(struct tpool *t, struct tpool_config cfg)
+{
+	cfg.threads_max =
+	    cfg.threads_max == 0 ? TPOOL_DEFAULT_THREADS_MAX : cfg.threads_max;
+	cfg.stack_size =
+	    cfg.stack_size == 0 ? TPOOL_DEFAULT_STACK_SIZE : cfg.stack_size;
+	t->cfg = cfg;
+	t->threads_count = 0;
+	t->threads_idle = 0;
+	t->lane_count = 0;
+	t->lane_idle = 0;
+	t->state = 0;
+	t->idle_epoch = 0;
+	t->lane_queued = 0;
+	t->paused = false;
+	pthread_mutex_init(&t->mu, NULL);
+	t->work_queue = (struct tpool_batch){0};
+	t->lane_queue = (struct tpool_batch){0};
+	t->locals = NULL;
+	t->idle_ids = NULL;
+	t->idle_len = 0;
+	t->local_queued = 0;
+	t->limits = NULL;
+	t->timer_ns = UINT64_MAX;
+	t->done = false;
+	pthread_cond_init(&t->lane_cond, NULL);
+	pthread_cond_init(&t->quiesce_cond, NULL);
+}
+
+void tpool_deinit(struct tpool *t)
+{
+	pthread_mutex_lock(&t->mu);
+	t->done = true;
+	atomic_store(&t->paused, false);
+	tpool_wake_idle(t, UINT_MAX);
+	pthread_mutex_unlock(&t->mu);
+
+	pthread_cond_broadcast(&t->lane_cond);
+
+	unsigned int n;
+	while ((n = atomic_load(&t->threads_count)) > 0)
+		tpool_futex_wait(&t->threads_count, n);
+	while ((n = atomic_load(&t->lane_count)) > 0)
+		tpool_futex_wait(&t->lane_count, n);
+
+	if (t->locals != NULL) {
+		for (unsigned int i = 0; i < t->cfg.threads_max; i++)
+			pthread_cond_destroy(&t->locals[i].cond);
+		free(t->locals);
+		free(t->idle_ids);
+	}
+	pthread_cond_destroy(&t->lane_cond);
+	pthread_cond_destroy(&t->quiesce_cond);
+}
+
+void tpool_pause(struct tpool *t)
+{
+	pthread_mutex_lock(&t->mu);
+	atomic_store(&t->paused, true);
+	while (atomic_load(&t->state) >= TPOOL_STATE_ACTIVE)
+		pthread_cond_wait(&t->quiesce_cond, &t->mu);
+	pthread_mutex_unlock(&t->mu);
+}
+
+void tpool_resume(struct tpool *t)
+{
+	pthread_mutex_lock(&t->mu);
+	atomic_store(&t->paused, false);
+	tpool_wake_idle(t, UINT_MAX);
+	pthread_mutex_unlock(&t->mu);
+
+	if (!t->cfg.busy_poll)
+		pthread_cond_broadcast(&t->lane_cond);
+}
+
+void tpool_wait_idle(struct tpool *t)
+{
+	unsigned int epoch = atomic_load(&t->idle_epoch);
+	unsigned int start = epoch >> 1;
+
+	while (1) {
+		if (atomic_load(&t->state) == 0 || (epoch >> 1) != start)
+			return;
+
+		// Flag ourselves as waiter, this fails if pool became idle.
+		if ((epoch & 1) == 0 &&
+		    !atomic_compare_exchange_strong(&t->idle_epoch, &epoch,
+						    epoch | 1))
+			continue;
+
+		tpool_futex_wait(&t->idle_epoch, epoch | 1);
+		epoch = atomic_load(&t->idle_epoch);
+	}
+}
+
+/**
+ * Marks end of a task execution, notifying idle waiters and calling idle
+ * callback if pool became idle.
+ */
+static void tpool_task_done(struct tpool *t)
+{
+	unsigned long long state =
+	    atomic_fetch_sub(&t->state, TPOOL_STATE_ACTIVE) -
+	    TPOOL_STATE_ACTIVE;
+	if (state != 0)
+		return;
+
+	unsigned int epoch = atomic_load(&t->idle_epoch);
+	while (!atomic_compare_exchange_weak(&t->idle_epoch, &epoch,
+					     (epoch + 2) & ~1u))
+		;
+	if (epoch & 1)
+		tpool_futex_wake(&t->idle_epoch, INT_MAX);
+
+	if (t->cfg.idle_fn != NULL)
+		(*t->cfg.idle_fn)(t);
+}
+
+/**
+ * Moves tasks of inbox of bulk thread `id` to its local queue, in the order
+ * they were resumed. Pool mutex must be held.
+ */
+static void tpool_inbox_drain(struct tpool *t, unsigned int id)
+{
+	struct tpool_local *l = &t->locals[id];
+	if (atomic_load(&l->inbox) == 0)
+		return;
+
+	// Inbox is a stack, reverse it.
+	struct tpool_task *task = (void *)atomic_exchange(&l->inbox, 0);
+	struct tpool_batch b = {0};
+	b.tail = task;
+	while (task != NULL) {
+		struct tpool_task *next = task->next;
+		task->next = b.head;
+		b.head = task;
+		b.size++;
+		task = next;
+	}
+
+	atomic_fetch_sub_explicit(&l->inbox_len, b.size, memory_order_relaxed);
+	atomic_fetch_add_explicit(&l->queued, b.size, memory_order_relaxed);
+	tpool_batch_push(&l->queue, b);
+	t->local_queued += b.size;
+}
+
+/**
+ * Pops a task of local queue of bulk thread `id`. Pool mutex must be held.
+ */
+static struct tpool_task *tpool_local_pop(struct tpool *t, unsigned int id)
+{
+	struct tpool_local *l = &t->locals[id];
+	struct tpool_task *task = tpool_batch_pop(&l->queue);
+	if (task != NULL) {
+		atomic_fetch_sub_explicit(&l->queued, 1, memory_order_relaxed);
+		t->local_queued--;
+	}
+	return task;
+}
+
+/**
+ * Steals a task of another thread's local queue, starting with thread next
+ * to `self`. Pool mutex must be held.
+ */
+static struct tpool_task *tpool_steal(struct tpool *t,
+				      struct tpool_thread *self)
+{
+	// Inboxes are filled without the mutex, queued count covers them.
+	if (t->locals == NULL ||
+	    (atomic_load(&t->state) & TPOOL_STATE_QUEUED_MASK) == 0)
+		return NULL;
+
+	unsigned int n = t->cfg.threads_max;
+	unsigned int start = self != NULL && !self->lane ? self->id + 1 : 0;
+	for (unsigned int i = 0; i < n; i++) {
+		// Inbox of a thread which isn't running is checked by its owner
+		// before it sleeps, or once it is woken up.
+		unsigned int id = (start + i) % n;
+		if (atomic_load(&t->locals[id].running))
+			tpool_inbox_drain(t, id);
+		struct tpool_task *task = tpool_local_pop(t, id);
+		if (task != NULL)
+			return task;
+	}
+	return NULL;
+}
+
+static int tpool_wake(struct tpool *t, unsigned int n);
+static void tpool_team_member_work(struct tpool_task *task);
+
+/**
+ * Removes first task of `b` executing `work`, NULL if there is none.
+ */
+static struct tpool_task *tpool_batch_remove(struct tpool_batch *b,
+					     tpool_work_fn work)
+{
+	// Tail's next pointer isn't cleared.
+	struct tpool_task *prev = NULL, *task = b->head;
+	for (unsigned int i = 0; i < b->size;
+	     i++, prev = task, task = task->next) {
+		if (task->work != work)
+			continue;
+		if (prev == NULL)
+			b->head = task->next;
+		else
+			prev->next = task->next;
+		if (b->tail == task)
+			b->tail = prev;
+		b->size--;
+		return task;
+	}
+	return NULL;
+}
+
+/**
+ * Pops a team member of thread's local queue or shared queue. Teams start as
+ * a whole even while pool is paused, so their executing members don't wait
+ * for the others at a barrier forever. Pool mutex must be held.
+ */
+static struct tpool_task *tpool_member_pop(struct tpool *t,
+					   struct tpool_thread *self)
+{
+	struct tpool_task *task = NULL;
+	if (self != NULL && !self->lane) {
+		struct tpool_local *l = &t->locals[self->id];
+		task = tpool_batch_remove(&l->queue, tpool_team_member_work);
+		if (task != NULL) {
+			atomic_fetch_sub_explicit(&l->queued, 1,
+						  memory_order_relaxed);
+			t->local_queued--;
+		}
+	}
+	if (task == NULL)
+		task = tpool_batch_remove(&t->work_queue,
+					  tpool_team_member_work);
+	if (task != NULL)
+		atomic_fetch_add(&t->state, TPOOL_STATE_ACTIVE - 1);
+	return task;
+}
+
+/**
+ * Pops next task a thread should execute: lane first, then thread's local
+ * queue, shared queue and finally other local queues. Reserved lane threads
+ * only take bulk work if `lane_share` is set. Pause is ignored, see
+ * tpool_next_task(). `self` is NULL for threads outside the pool. Pool mutex
+ * must be held.
+ */
+static struct tpool_task *tpool_pop_task(struct tpool *t,
+					 struct tpool_thread *self)
+{
+	struct tpool_task *task = tpool_batch_pop(&t->lane_queue);
+	if (task != NULL) {
+		atomic_fetch_sub_explicit(&t->lane_queued, 1,
+					  memory_order_relaxed);
+		atomic_fetch_add(&t->state, TPOOL_STATE_ACTIVE - 1);
+		return task;
+	}
+	if (self != NULL && self->lane && !t->cfg.lane_share)
+		return NULL;
+
+	if (self != NULL && !self->lane) {
+		tpool_inbox_drain(t, self->id);
+		task = tpool_local_pop(t, self->id);
+	}
+	if (task == NULL && t->limits != NULL) {
+		// Calling thread takes one of released tasks.
+		unsigned int released = tpool_timers_fire(t);
+		if (released > 1)
+			tpool_wake(t, released - 1);
+	}
+	if (task == NULL)
+		task = tpool_batch_pop(&t->work_queue);
+	if (task == NULL)
+		task = tpool_steal(t, self);
+	if (task != NULL)
+		atomic_fetch_add(&t->state, TPOOL_STATE_ACTIVE - 1);
+	return task;
+}
+
+/**
+ * Pops next task a thread should execute, see tpool_pop_task(). Only team
+ * members are returned while pool is paused. Pool mutex must be held.
+ */
+static struct tpool_task *tpool_next_task(struct tpool *t,
+					  struct tpool_thread *self)
+{
+	if (atomic_load_explicit(&t->paused, memory_order_relaxed))
+		return tpool_member_pop(t, self);
+	return tpool_pop_task(t, self);
+}
+
+/**
+ * Executes a task returned by tpool_next_task(). Pool mutex must not be held.
+ */
+static void tpool_execute(struct tpool *t, struct tpool_thread *self,
+			  struct tpool_task *task)
+{
+	(*task->work)(task);
+
+	// Cleared before task is done so a thread scheduling after observing
+	// it knows this thread will check its local queue.
+	if (self != NULL && !self->lane)
+		atomic_store(&t->locals[self->id].running, false);
+	tpool_task_done(t);
+
+	// Notify tpool_pause() once last executing task is done.
+	if (atomic_load(&t->paused)) {
+		pthread_mutex_lock(&t->mu);
+		if (atomic_load(&t->state) < TPOOL_STATE_ACTIVE)
+			pthread_cond_broadcast(&t->quiesce_cond);
+		pthread_mutex_unlock(&t->mu);
+	}
+}
+
+/**
+ * Executes a queued task on calling thread. A task of the pool waiting on
+ * work of the pool keeps executing queued tasks while pool is paused, so it
+ * can be done and tpool_pause() return. Returns false if there is nothing to
+ * execute.
+ */
+static bool tpool_help(struct tpool *t)
+{
+	// Bulk threads of the pool serve their local queue first.
+	struct tpool_thread *self = NULL;
+	if (tpool_self == t && !tpool_self_thread->lane)
+		self = tpool_self_thread;
+
+	pthread_mutex_lock(&t->mu);
+	struct tpool_task *task = tpool_self == t ? tpool_pop_task(t, self)
+						  : tpool_next_task(t, self);
+	pthread_mutex_unlock(&t->mu);
+
+	if (task == NULL)
+		return false;
+	tpool_execute(t, NULL, task);
+	return true;
+}
+
+/**
+ * Spins until a task the thread can execute is queued or
+ * TPOOL_BUSY_POLL_SPINS iterations elapsed. Pool mutex must be held, it is
+ * released while spinning.
+ */
+static void tpool_busy_poll(struct tpool *t, struct tpool_thread *self)
+{
+	bool bulk = !self->lane || t->cfg.lane_share;
+
+	pthread_mutex_unlock(&t->mu);
+	for (unsigned int i = 0; i < TPOOL_BUSY_POLL_SPINS; i++) {
+		if (atomic_load_explicit(&t->paused, memory_order_relaxed)) {
+			tpool_cpu_relax();
+			continue;
+		}
+		if (atomic_load_explicit(&t->lane_queued,
+					 memory_order_relaxed) > 0)
+			break;
+		if (bulk && (atomic_load_explicit(&t->state,
+						  memory_order_relaxed) &
+			     TPOOL_STATE_QUEUED_MASK) > 0)
+			break;
+		tpool_cpu_relax();
+	}
+	pthread_mutex_lock(&t->mu);
+}
+
+/**
+ * Pins thread to its configured CPU, if any.
+ */
+static void tpool_thread_pin(struct tpool_thread *self)
+{
+	const struct tpool_config *cfg = &self->pool->cfg;
+	if (cfg->cpus_len == 0)
+		return;
+
+#if defined(__linux__) && defined(_GNU_SOURCE)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cfg->cpus[self->id % cfg->cpus_len], &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+/**
+ * Applies configured scheduling policy to calling thread, falling back to
+ * SCHED_OTHER if real-time policy isn't permitted.
+ */
+static void tpool_thread_sched(struct tpool_thread *self)
+{
+	const struct tpool_config *cfg = &self->pool->cfg;
+	struct sched_param param = {0};
+	int policy = SCHED_OTHER;
+
+	switch (cfg->policy) {
+	case TPOOL_POLICY_INHERIT:
+		return;
+	case TPOOL_POLICY_OTHER:
+		break;
+	case TPOOL_POLICY_BATCH:
+#ifdef SCHED_BATCH
+		policy = SCHED_BATCH;
+#endif
+		break;
+	case TPOOL_POLICY_IDLE:
+#ifdef SCHED_IDLE
+		policy = SCHED_IDLE;
+#endif
+		break;
+	case TPOOL_POLICY_FIFO:
+		policy = SCHED_FIFO;
+		param.sched_priority = cfg->priority;
+		break;
+	}
+
+	if (pthread_setschedparam(pthread_self(), policy, &param) != 0) {
+		if (policy != SCHED_FIFO)
+			return;
+		policy = SCHED_OTHER;
+		param.sched_priority = 0;
+		pthread_setschedparam(pthread_self(), policy, &param);
+	}
+
+	// Nice value is per thread on Linux.
+#if defined(__linux__) && defined(_GNU_SOURCE)
+	if (policy != SCHED_FIFO && cfg->nice != 0)
+		setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), cfg->nice);
+#endif
+}
+
+struct tpool *tpool_current(void)
+{
+	return tpool_self;
+}
+
+unsigned int tpool_worker_id(void)
+{
+	return tpool_self_thread != NULL ? tpool_self_thread->id : UINT_MAX;
+}
+
+/**
+ * Main function of thread part of the thread pool.
+ */
+static void *tpool_thread_main(void *ptr)
+{
+	struct tpool_thread *self = ptr;
+	struct tpool *t = self->pool;
+	tpool_self = t;
+	tpool_self_thread = self;
+	atomic_uint *count = self->lane ? &t->lane_count : &t->threads_count;
+	atomic_uint *idle = self->lane ? &t->lane_idle : &t->threads_idle;
+	struct tpool_local *local = self->lane ? NULL : &t->locals[self->id];
+	pthread_cond_t *cond = self->lane ? &t->lane_cond : &local->cond;
+
+	tpool_thread_pin(self);
+	tpool_thread_sched(self);
+
+	pthread_mutex_lock(&t->mu);
+	while (1) {
+		struct tpool_task *task = tpool_next_task(t, self);
+		if (task != NULL) {
+			if (!self->lane)
+				atomic_store(&local->running, true);
+			pthread_mutex_unlock(&t->mu);
+			tpool_execute(t, self, task);
+			pthread_mutex_lock(&t->mu);
+			continue;
+		}
+
+		// Reserved lane threads don't serve pool's timer, neither do
+		// threads of a paused pool.
+		bool timer = t->limits != NULL && !self->lane &&
+			     !atomic_load(&t->paused);
+		if (t->done && !timer)
+			break;
+
+		// Inbox producers only wake up sleeping threads, inbox must be
+		// checked again once flagged. A paused thread can't run it and
+		// sleeps until tpool_resume() wakes it up.
+		if (!self->lane && !t->cfg.busy_poll) {
+			atomic_store(&local->sleeping, true);
+			if (atomic_load(&local->inbox) != 0 &&
+			    !atomic_load(&t->paused)) {
+				atomic_store(&local->sleeping, false);
+				continue;
+			}
+		}
+
+		// Bulk threads wait on their own condition variable so work
+		// queued on their local queue can wake them up.
+		atomic_fetch_add(idle, 1);
+		if (!self->lane && !t->cfg.busy_poll)
+			tpool_idle_push(t, self->id);
+		if (t->cfg.busy_poll)
+			tpool_busy_poll(t, self);
+		else if (timer)
+			tpool_cond_timedwait(cond, &t->mu, t->timer_ns);
+		else
+			pthread_cond_wait(cond, &t->mu);
+		if (!self->lane && !t->cfg.busy_poll) {
+			tpool_idle_remove(t, self->id);
+			atomic_store(&local->sleeping, false);
+		}
+		atomic_fetch_sub(idle, 1);
+	}
+
+	pthread_mutex_unlock(&t->mu);
+	free(self);
+
+	// Last access to the pool, tpool_deinit() may return right after.
+	if (atomic_fetch_sub(count, 1) == 1)
+		tpool_futex_wake(count, INT_MAX);
+	return NULL;
+}
+
+/**
+ * Spawns a new thread, reserved for lane if `lane` is set, if thread limit
+ * isn't reached. Returns 1 if a thread was spawned, 0 if limit is reached and
+ * negative error code of pthread_create() otherwise. Pool mutex must be held.
+ */
+static int tpool_spawn(struct tpool *t, bool lane)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+	struct tpool_thread *thread;
+	atomic_uint *count = lane ? &t->lane_count : &t->threads_count;
+	unsigned int max = lane ? t->cfg.lane_threads : t->cfg.threads_max;
+	int err;
+
+	if (!lane && t->locals == NULL) {
+		err = tpool_locals_init(t);
+		if (err < 0)
+			return err;
+	}
+
+	unsigned int id = atomic_load(count);
+	do {
+		if (id >= max)
+			return 0;
+	} while (!atomic_compare_exchange_weak(count, &id, id + 1));
+
+	thread = malloc(sizeof(*thread));
+	if (thread == NULL) {
+		err = ENOMEM;
+		goto alloc_error;
+	}
+	thread->pool = t;
+	thread->id = lane ? t->cfg.threads_max + id : id;
+	thread->lane = lane;
+
+	err = pthread_attr_init(&attr);
+	if (err)
+		goto attr_error;
+
+	pthread_attr_setstacksize(&attr, t->cfg.stack_size);
+
+	// Thread may exit and free its structure before pthread_create()
+	// returns, so it's created detached and nothing is written in it.
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create(&tid, &attr, &tpool_thread_main, thread);
+	if (err)
+		goto create_error;
+
+	pthread_attr_destroy(&attr);
+
+	return 1;
+
+create_error:
+	pthread_attr_destroy(&attr);
+attr_error:
+	free(thread);
+alloc_error:
+	atomic_fetch_sub(count, 1);
+	return -err;
+}
+
+/**
+ * Wakes up to `n` idle threads, spawning new ones if not enough are idle. If
+ * thread limit is reached, idle lane threads sharing bulk work are woken up
+ * instead. Pool mutex must be held.
+ */
+static int tpool_wake(struct tpool *t, unsigned int n)
+{
+	// Spawn new threads if possible and needed.
+	unsigned int idle = atomic_load(&t->threads_idle);
+	unsigned int spawned = 0;
+	while (idle + spawned < n) {
+		int err = tpool_spawn(t, false);
+		if (err < 0)
+			return err;
+		if (err == 0)
+			break;
+		spawned++;
+	}
+
+	// Idle threads are spinning, no need to wake them up.
+	if (t->cfg.busy_poll)
+		return 0;
+
+	// Wake up idle threads.
+	if (idle > 0) {
+		tpool_wake_idle(t, n);
+	} else if (spawned == 0 && t->cfg.lane_share &&
+		   atomic_load(&t->lane_idle) > 0) {
+		pthread_cond_signal(&t->lane_cond);
+	}
+
+	return 0;
+}
+
+/**
+ * Wakes up an idle reserved lane thread or spawns a new one if none is idle.
+ * If all reserved threads are busy, lane work is handed to bulk threads. Pool
+ * mutex must be held.
+ */
+static int tpool_wake_lane(struct tpool *t)
+{
+	unsigned int idle = atomic_load(&t->lane_idle);
+	if (idle == 0) {
+		int spawned = tpool_spawn(t, true);
+		if (spawned < 0)
+			return spawned;
+		idle += (unsigned int)spawned;
+	}
+
+	if (idle > 0) {
+		if (!t->cfg.busy_poll)
+			pthread_cond_signal(&t->lane_cond);
+		return 0;
+	}
+
+	return tpool_wake(t, 1);
+}
+
+int tpool_schedule(struct tpool *t, struct tpool_batch b)
+{
+	if (b.size == 0)
+		return 0;
+
+	// Push work.
+	pthread_mutex_lock(&t->mu);
+	tpool_batch_push(&t->work_queue, b);
+	atomic_fetch_add(&t->state, b.size);
+	int err = tpool_wake(t, b.size);
+	pthread_mutex_unlock(&t->mu);
+
+	return err;
+}
+
+int tpool_schedule_lane(struct tpool *t, struct tpool_batch b)
+{
+	if (b.size == 0)
+		return 0;
+
+	// Push work.
+	pthread_mutex_lock(&t->mu);
+	tpool_batch_push(&t->lane_queue, b);
+	atomic_fetch_add_explicit(&t->lane_queued, b.size,
+				  memory_order_relaxed);
+	atomic_fetch_add(&t->state, b.size);
+	int err = tpool_wake_lane(t);
+	pthread_mutex_unlock(&t->mu);
+
+	return err;
+}
+
+int tpool_schedule_limited(struct tpool *t, struct tpool_rate_limit *rl,
+			   struct tpool_batch b)
+{
+	if (b.size == 0)
+		return 0;
+
+	// Park work and release what tokens allow.
+	pthread_mutex_lock(&t->mu);
+	tpool_batch_push(&rl->parked, b);
+	uint64_t deadline;
+	unsigned int released =
+	    tpool_rate_limit_release(t, rl, tpool_now_ns(), &deadline);
+	if (deadline != 0) {
+		if (!rl->armed) {
+			rl->next = t->limits;
+			t->limits = rl;
+			rl->armed = true;
+		}
+		if (deadline < t->timer_ns)
+			t->timer_ns = deadline;
+	}
+
+	// Idle threads must rearm their timer even if no task was released.
+	int err = tpool_wake(t, released > 0 ? released : 1);
+	pthread_mutex_unlock(&t->mu);
+
+	return err;
+}
+
+/**
+ * Wakes up bulk thread `id` for `n` tasks queued on its local queue or inbox
+ * if it's idle, or other threads otherwise. Pool mutex must be held.
+ */
+static int tpool_wake_local(struct tpool *t, unsigned int id, unsigned int n)
+{
+	struct tpool_local *l = &t->locals[id];
+	if (t->cfg.busy_poll)
+		return tpool_wake(t, n);
+
+	if (l->idle_pos != UINT_MAX) {
+		tpool_idle_remove(t, id);
+		pthread_cond_signal(&l->cond);
+	} else if (id >= atomic_load(&t->threads_count) ||
+		   atomic_load(&l->running)) {
+		// Thread doesn't exist or is busy, others may steal.
+		return tpool_wake(t, n);
+	}
+
+	// Otherwise thread is about to check its local queue.
+	return n > 1 ? tpool_wake(t, n - 1) : 0;
+}
+
+/**
+ * Queues a batch on local queue of bulk thread `id` and wakes it up if it's
+ * idle, or other threads otherwise. Batch goes to shared queue if no thread
+ * was spawned yet. Pool mutex must be held.
+ */
+static int tpool_push_local(struct tpool *t, unsigned int id,
+			    struct tpool_batch b)
+{
+	atomic_fetch_add(&t->state, b.size);
+	if (t->locals == NULL) {
+		tpool_batch_push(&t->work_queue, b);
+		return tpool_wake(t, b.size);
+	}
+
+	struct tpool_local *l = &t->locals[id];
+	atomic_fetch_add_explicit(&l->queued, b.size, memory_order_relaxed);
+	tpool_batch_push(&l->queue, b);
+	t->local_queued += b.size;
+	return tpool_wake_local(t, id, b.size);
+}
+
+int tpool_schedule_affine(struct tpool *t, uint64_t key, struct tpool_batch b)
+{
+	if (b.size == 0)
+		return 0;
+
+	// Fibonacci hashing spreads aligned addresses over threads.
+	key *= UINT64_C(0x9e3779b97f4a7c15);
+	unsigned int id = (unsigned int)((key >> 32) % t->cfg.threads_max);
+
+	pthread_mutex_lock(&t->mu);
+	int err = tpool_push_local(t, id, b);
+	pthread_mutex_unlock(&t->mu);
+
+	return err;
+}
+
+int tpool_resume_on(struct tpool *t, unsigned int worker,
+		    struct tpool_task *task)
+{
+	// Local queues are allocated along the first thread.
+	if (worker >= t->cfg.threads_max || atomic_load(&t->threads_count) == 0)
+		return tpool_schedule(t, tpool_batch_from_task(task));
+
+	// Overloaded thread, let any thread take it.
+	struct tpool_local *l = &t->locals[worker];
+	unsigned int len = atomic_fetch_add_explicit(&l->inbox_len, 1,
+						     memory_order_relaxed);
+	if (len >= TPOOL_INBOX_MAX) {
+		atomic_fetch_sub_explicit(&l->inbox_len, 1,
+					  memory_order_relaxed);
+		return tpool_schedule(t, tpool_batch_from_task(task));
+	}
+
+	// Counted first so thieves look for it once it's pushed.
+	atomic_fetch_add(&t->state, 1);
+	uintptr_t head = atomic_load(&l->inbox);
+	do {
+		task->next = (struct tpool_task *)head;
+	} while (!atomic_compare_exchange_weak(&l->inbox, &head,
+					       (uintptr_t)task));
+
+	// A running thread checks its inbox once its task is done, unless
+	// threads able to steal it are idle.
+	if (t->cfg.busy_poll)
+		return 0;
+	if (!atomic_load(&l->sleeping) &&
+	    (!atomic_load(&l->running) || atomic_load(&t->threads_idle) == 0))
+		return 0;
+
+	pthread_mutex_lock(&t->mu);
+	int err = tpool_wake_local(t, worker, 1);
+	pthread_mutex_unlock(&t->mu);
+
+	return err;
+}
+
+void tpool_join_init(struct tpool_join *j)
+{
+	j->pending = 0;
+}
+
+int tpool_fork(struct tpool *t, struct tpool_join *j, struct tpool_task *task)
+{
+	atomic_fetch_add(&j->pending, 1);
+
+	// Joining thread pops its own forks first, others steal them.
+	unsigned int id = tpool_self == t ? tpool_worker_id() : UINT_MAX;
+	if (id >= t->cfg.threads_max)
+		return tpool_schedule(t, tpool_batch_from_task(task));
+
+	pthread_mutex_lock(&t->mu);
+	int err = tpool_push_local(t, id, tpool_batch_from_task(task));
+	pthread_mutex_unlock(&t->mu);
+
+	return err;
+}
+
+void tpool_join_done(struct tpool_join *j)
+{
+	if (atomic_fetch_sub(&j->pending, 1) == 1)
+		tpool_futex_wake(&j->pending, INT_MAX);
+}
+
+void tpool_join_wait(struct tpool *t, struct tpool_join *j)
+{
+	unsigned int n;
+	while ((n = atomic_load(&j->pending)) > 0) {
+		if (tpool_help(t))
+			continue;
+		tpool_futex_wait(&j->pending, n);
+	}
+}
+
+bool tpool_want_fork(struct tpool *t)
+{
+	uint64_t state = atomic_load_explicit(&t->state, memory_order_relaxed);
+	uint64_t queued = state & TPOOL_STATE_QUEUED_MASK;
+	unsigned int id = tpool_self == t ? tpool_worker_id() : UINT_MAX;
+	if (id < t->cfg.threads_max)
+		queued = atomic_load_explicit(&t->locals[id].queued,
+					      memory_order_relaxed);
+
+	unsigned int count =
+	    atomic_load_explicit(&t->threads_count, memory_order_relaxed);
+	uint64_t takers =
+	    atomic_load_explicit(&t->threads_idle, memory_order_relaxed);
+
+	if (count < t->cfg.threads_max)
+		takers += t->cfg.threads_max - count;
+	return queued < takers + TPOOL_FORK_SURPLUS;
+}
+
+/**
+ * Forked half of a group of functions.
+ */
+struct tpool_when_half {
+	struct tpool_task task;
+	struct tpool_join *join;
+	struct tpool_when *when;
+	size_t begin;
+	size_t end;
+};
+
+static void tpool_when_run(struct tpool_when *w, size_t begin, size_t end);
+
+static void tpool_when_half_work(struct tpool_task *task)
+{
+	struct tpool_when_half *h = (struct tpool_when_half *)task;
+	tpool_when_run(h->when, h->begin, h->end);
+	tpool_join_done(h->join);
+}
+
+static void tpool_when_run(struct tpool_when *w, size_t begin, size_t end)
+{
+	struct tpool_join join;
+	struct tpool_when_half half;
+
+	if (end - begin == 1) {
+		if (atomic_load_explicit(&w->cancelled, memory_order_relaxed))
+			return;
+
+		(*w->fns[begin].fn)(w->fns[begin].ctx);
+
+		size_t none = SIZE_MAX;
+		if (atomic_compare_exchange_strong(&w->first, &none, begin) &&
+		    w->any)
+			atomic_store(&w->cancelled, true);
+		return;
+	}
+
+	// Fork second half, execute first one so functions start roughly in
+	// order.
+	tpool_join_init(&join);
+	half.task.work = tpool_when_half_work;
+	half.join = &join;
+	half.when = w;
+	half.begin = begin + (end - begin) / 2;
+	half.end = end;
+
+	tpool_fork(w->pool, &join, &half.task);
+	tpool_when_run(w, begin, half.begin);
+	tpool_join_wait(w->pool, &join);
+}
+
+/**
+ * Runs a group of functions and returns index of the first one that
+ * returned.
+ */
+static size_t tpool_when_start(struct tpool *t, struct tpool_when *w,
+			       const struct tpool_invoke *fns, size_t fns_len,
+			       bool any)
+{
+	w->pool = t;
+	w->fns = fns;
+	w->cancelled = false;
+	w->first = SIZE_MAX;
+	w->any = any;
+	if (fns_len > 0)
+		tpool_when_run(w, 0, fns_len);
+	return atomic_load(&w->first);
+}
+
+void tpool_parallel_invoke(struct tpool *t, const struct tpool_invoke *fns,
+			   size_t fns_len)
+{
+	struct tpool_when w;
+	tpool_when_start(t, &w, fns, fns_len, false);
+}
+
+void tpool_when_all(struct tpool *t, struct tpool_when *w,
+		    const struct tpool_invoke *fns, size_t fns_len)
+{
+	tpool_when_start(t, w, fns, fns_len, false);
+}
+
+size_t tpool_when_any(struct tpool *t, struct tpool_when *w,
+		      const struct tpool_invoke *fns, size_t fns_len)
+{
+	return tpool_when_start(t, w, fns, fns_len, true);
+}
+
+void tpool_when_cancel(struct tpool_when *w)
+{
+	atomic_store(&w->cancelled, true);
+}
+
+bool tpool_when_cancelled(struct tpool_when *w)
+{
+	return atomic_load_explicit(&w->cancelled, memory_order_relaxed);
+}
+
+void tpool_future_init(struct tpool_future *f)
+{
+	f->value = NULL;
+	f->state = 0;
+	f->pool = NULL;
+	f->continuation = NULL;
+	f->worker = UINT_MAX;
+}
+
+int tpool_future_set(struct tpool_future *f, void *value)
+{
+	f->value = value;
+
+	// Continuation must be read before waking up waiters, future may be
+	// freed as soon as they're awake.
+	unsigned int state = atomic_fetch_or(&f->state, TPOOL_FUTURE_READY);
+	struct tpool *t = NULL;
+	struct tpool_task *task = NULL;
+	unsigned int worker = UINT_MAX;
+	if (state & TPOOL_FUTURE_CONTINUATION) {
+		t = f->pool;
+		task = f->continuation;
+		worker = f->worker;
+	}
+
+	if (state & TPOOL_FUTURE_WAITERS)
+		tpool_futex_wake(&f->state, INT_MAX);
+	if (state & TPOOL_FUTURE_CONTINUATION)
+		return tpool_resume_on(t, worker, task);
+	return 0;
+}
+
+bool tpool_future_ready(struct tpool_future *f)
+{
+	return atomic_load(&f->state) & TPOOL_FUTURE_READY;
+}
+
+void *tpool_future_get(struct tpool_future *f)
+{
+	unsigned int state = atomic_load(&f->state);
+
+	while (!(state & TPOOL_FUTURE_READY)) {
+		// Flag ourselves as waiter, this fails if future was set.
+		if (!(state & TPOOL_FUTURE_WAITERS) &&
+		    !atomic_compare_exchange_weak(
+			&f->state, &state, state | TPOOL_FUTURE_WAITERS))
+			continue;
+
+		tpool_futex_wait(&f->state, state | TPOOL_FUTURE_WAITERS);
+		state = atomic_load(&f->state);
+	}
+
+	return f->value;
+}
+
+int tpool_future_then(struct tpool *t, struct tpool_future *f,
+		      struct tpool_task *task)
+{
+	unsigned int state = atomic_load(&f->state);
+
+	f->pool = t;
+	f->continuation = task;
+	f->worker = tpool_self == t ? tpool_worker_id() : UINT_MAX;
+	do {
+		if (state & TPOOL_FUTURE_READY)
+			return tpool_resume_on(t, f->worker, task);
+	} while (!atomic_compare_exchange_weak(
+	    &f->state, &state, state | TPOOL_FUTURE_CONTINUATION));
+
+	return 0;
+}
+
+/**
+ * Task executing a team member.
+ */
+static void tpool_team_member_work(struct tpool_task *task)
+{
+	struct tpool_team_member *m = (struct tpool_team_member *)task;
+	struct tpool_team *team = m->team;
+
+	(*team->fn)(m, team->ctx);
+
+	// Team may be freed right after.
+	if (atomic_fetch_sub(&team->running, 1) == 1)
+		tpool_futex_wake(&team->running, 1);
+}
+
+/**
+ * Schedules members 1 to `size` - 1 of a team started by pool thread `self`
+ * on threads free to run them right away: idle threads, preferably the one
+ * which would run the member in a team started outside the pool, then new
+ * threads. Busy threads may be waiting for the calling thread, so members
+ * aren't left to them. Returns team size, reduced to the number of free
+ * threads plus one, and sets `err` if a thread can't be spawned. Pool mutex
+ * must be held.
+ */
+static unsigned int tpool_team_place(struct tpool *t, struct tpool_team *team,
+				     unsigned int size, unsigned int self,
+				     int *err)
+{
+	// Spinning threads take queued tasks first.
+	unsigned int spinning = 0;
+	if (t->cfg.busy_poll) {
+		unsigned int idle = atomic_load(&t->threads_idle);
+		unsigned int queued = (unsigned int)(atomic_load(&t->state) &
+						     TPOOL_STATE_QUEUED_MASK);
+		spinning = idle > queued ? idle - queued : 0;
+	}
+
+	unsigned int n;
+	for (n = 1; n < size; n++) {
+		struct tpool_batch b =
+		    tpool_batch_from_task(&team->members[n].task);
+		unsigned int id = n - 1 < self ? n - 1 : n;
+
+		if (spinning > 0) {
+			spinning--;
+			atomic_fetch_add(&t->state, 1);
+			tpool_batch_push(&t->work_queue, b);
+			continue;
+		}
+
+		if (t->cfg.busy_poll || t->locals == NULL ||
+		    t->locals[id].idle_pos == UINT_MAX) {
+			if (!t->cfg.busy_poll && t->idle_len > 0) {
+				id = t->idle_ids[t->idle_len - 1];
+			} else {
+				// New thread checks its local queue first.
+				id = atomic_load(&t->threads_count);
+				int spawned = tpool_spawn(t, false);
+				if (spawned < 0)
+					*err = spawned;
+				if (spawned <= 0)
+					break;
+			}
+		}
+
+		struct tpool_local *l = &t->locals[id];
+		atomic_fetch_add(&t->state, 1);
+		atomic_fetch_add_explicit(&l->queued, 1, memory_order_relaxed);
+		tpool_batch_push(&l->queue, b);
+		t->local_queued++;
+		if (l->idle_pos != UINT_MAX) {
+			tpool_idle_remove(t, id);
+			pthread_cond_signal(&l->cond);
+		}
+	}
+	return n;
+}
+
+int tpool_team_run(struct tpool *t, struct tpool_team *team, unsigned int size,
+		   tpool_team_fn fn, void *ctx)
+{
+	struct tpool_batch b;
+	unsigned int n;
+	int err = 0;
+
+	// A pool thread calling is one of the threads running the team.
+	unsigned int self = tpool_self == t ? tpool_worker_id() : UINT_MAX;
+	unsigned int threads = t->cfg.threads_max;
+	if (self >= threads)
+		threads++;
+
+	if (size > TPOOL_TEAM_MAX)
+		size = TPOOL_TEAM_MAX;
+	if (size > threads)
+		size = threads;
+	if (size == 0)
+		size = 1;
+
+	team->fn = fn;
+	team->ctx = ctx;
+	team->arrived = 0;
+	team->generation = 0;
+	team->cursor = 0;
+	for (unsigned int i = 0; i < size; i++) {
+		struct tpool_team_member *m = &team->members[i];
+		m->team = team;
+		m->id = i;
+		m->base = 0;
+		m->task.work = tpool_team_member_work;
+	}
+
+	// Member i runs on thread i - 1 unless it's stolen, skipping calling
+	// thread which runs member 0. No member can start before the mutex
+	// is released, so team size can still shrink.
+	pthread_mutex_lock(&t->mu);
+	if (tpool_self == t) {
+		size = tpool_team_place(t, team, size, self, &err);
+	} else {
+		for (unsigned int i = 1; i < size; i++) {
+			b = tpool_batch_from_task(&team->members[i].task);
+			int e = tpool_push_local(t, i - 1, b);
+			if (e < 0)
+				err = e;
+		}
+	}
+	team->size = size;
+	team->running = size;
+	pthread_mutex_unlock(&t->mu);
+	tpool_team_member_work(&team->members[0].task);
+
+	while ((n = atomic_load(&team->running)) > 0)
+		tpool_futex_wait(&team->running, n);
+
+	return err < 0 ? err : (int)size;
+}
+
+void tpool_team_barrier(struct tpool_team_member *m)
+{
+	struct tpool_team *team = m->team;
+	unsigned int gen = atomic_load(&team->generation);
+
+	// Last member to arrive starts a new generation.
+	if (atomic_fetch_add(&team->arrived, 1) + 1 == team->size) {
+		atomic_store(&team->arrived, 0);
+		gen = atomic_exchange(&team->generation, (gen + 2) & ~1u);
+		if (gen & 1)
+			tpool_futex_wake(&team->generation, INT_MAX);
+		return;
+	}
+
+	for (unsigned int i = 0; i < TPOOL_BARRIER_SPINS; i++) {
+		if ((atomic_load(&team->generation) >> 1) != (gen >> 1))
+			return;
+		tpool_cpu_relax();
+	}
+
+	while (1) {
+		unsigned int cur = atomic_load(&team->generation);
+		if ((cur >> 1) != (gen >> 1))
+			return;
+
+		// Flag ourselves as waiter, this fails if generation changed.
+		if ((cur & 1) == 0 &&
+		    !atomic_compare_exchange_strong(&team->generation, &cur,
+						    cur | 1))
+			continue;
+
+		tpool_futex_wait(&team->generation, cur | 1);
+	}
+}
+
+/**
+ * Claims up to `chunk` iterations of dynamic loop occupying [base, base + n)
+ * on team's cursor. Returns number of claimed iterations and sets `i` to the
+ * first one relative to `base`, or returns 0 once the loop is exhausted.
+ */
+static size_t tpool_loop_claim(atomic_size_t *cursor, size_t base, size_t n,
+			       size_t chunk, size_t *i)
+{
+	// Cursor only grows and is past every previous loop.
+	size_t pos = atomic_load_explicit(cursor, memory_order_relaxed);
+	do {
+		if (pos - base >= n)
+			return 0;
+		if (chunk > n - (pos - base))
+			chunk = n - (pos - base);
+	} while (!atomic_compare_exchange_weak_explicit(
+	    cursor, &pos, pos + chunk, memory_order_relaxed,
+	    memory_order_relaxed));
+
+	*i = pos - base;
+	return chunk;
+}
+
+/**
+ * Claims chunks of guided self-scheduled loop.
+ */
+static void tpool_loop_guided(atomic_size_t *cursor, size_t base, size_t size,
+			      size_t n, size_t min_chunk, size_t begin,
+			      tpool_range_fn fn, void *ctx)
+{
+	size_t i = 0, len;
+	do {
+		// Claimed chunk is clamped to remaining iterations.
+		size_t pos = atomic_load_explicit(cursor, memory_order_relaxed);
+		size_t left = pos - base < n ? n - (pos - base) : 0;
+		size_t chunk = left / (2 * size);
+		if (chunk < min_chunk)
+			chunk = min_chunk;
+
+		len = tpool_loop_claim(cursor, base, n, chunk, &i);
+		if (len > 0)
+			(*fn)(ctx, begin + i, begin + i + len);
+	} while (len > 0);
+}
+
+/**
+ * Claims chunks of adaptive self-scheduled loop, sized from measured cost of
+ * previous chunks.
+ */
+static void tpool_loop_adaptive(atomic_size_t *cursor, size_t base,
+				size_t size, size_t n, size_t chunk,
+				size_t begin, tpool_range_fn fn, void *ctx)
+{
+	uint64_t iter_ns = 0;
+
+	while (1) {
+		// Keep enough iterations for other members near the end.
+		size_t pos = atomic_load_explicit(cursor, memory_order_relaxed);
+		size_t fair = pos - base < n ? (n - (pos - base)) / size : 0;
+		if (chunk > fair)
+			chunk = fair == 0 ? 1 : fair;
+
+		size_t i;
+		size_t len = tpool_loop_claim(cursor, base, n, chunk, &i);
+		if (len == 0)
+			break;
+
+		uint64_t start = tpool_now_ns();
+		(*fn)(ctx, begin + i, begin + i + len);
+		uint64_t ns = (tpool_now_ns() - start) / len;
+
+		// Exponentially weighted moving average of iteration cost.
+		iter_ns = iter_ns == 0 ? ns + 1 : (3 * iter_ns + ns) / 4 + 1;
+		chunk = (size_t)(TPOOL_LOOP_CHUNK_NS / iter_ns);
+		if (chunk == 0)
+			chunk = 1;
+	}
+}
+
+void tpool_team_for(struct tpool_team_member *m, size_t begin, size_t end,
+		    struct tpool_loop loop, tpool_range_fn fn, void *ctx)
+{
+	struct tpool_team *team = m->team;
+	size_t size = team->size;
+	size_t id = m->id;
+	size_t n = end > begin ? end - begin : 0;
+	size_t chunk = loop.chunk == 0 ? 1 : loop.chunk;
+
+	// Dynamic loops follow each other on team's cursor, which is never
+	// reset, so members still claiming from a previous loop find it
+	// exhausted.
+	atomic_size_t *cursor = &team->cursor;
+	size_t base = m->base;
+	if (loop.schedule == TPOOL_LOOP_GUIDED ||
+	    loop.schedule == TPOOL_LOOP_ADAPTIVE)
+		m->base += n;
+
+	switch (loop.schedule) {
+	case TPOOL_LOOP_STATIC: {
+		// First n % size members get one more iteration.
+		size_t q = n / size, r = n % size;
+		size_t first = begin + id * q + (id < r ? id : r);
+		size_t last = first + q + (id < r ? 1 : 0);
+		if (first < last)
+			(*fn)(ctx, first, last);
+		break;
+	}
+	case TPOOL_LOOP_CYCLIC:
+		for (size_t i = id * chunk; i < n; i += size * chunk) {
+			size_t len = n - i < chunk ? n - i : chunk;
+			(*fn)(ctx, begin + i, begin + i + len);
+		}
+		break;
+	case TPOOL_LOOP_GUIDED:
+		tpool_loop_guided(cursor, base, size, n, chunk, begin, fn,
+				  ctx);
+		break;
+	case TPOOL_LOOP_ADAPTIVE:
+		tpool_loop_adaptive(cursor, base, size, n, chunk, begin, fn,
+				    ctx);
+		break;
+	}
+
+	if (!loop.nowait)
+		tpool_team_barrier(m);
+}
+
+/**
+ * Arguments of a tpool_parallel_for() team.
+ */
+struct tpool_parallel_for {
+	size_t begin;
+	size_t end;
+	struct tpool_loop loop;
+	tpool_range_fn fn;
+	void *ctx;
+};
+
+static void tpool_parallel_for_member(struct tpool_team_member *m, void *ptr)
+{
+	struct tpool_parallel_for *pf = ptr;
+	tpool_team_for(m, pf->begin, pf->end, pf->loop, pf->fn, pf->ctx);
+}
+
+int tpool_parallel_for(struct tpool *t, size_t begin, size_t end,
+		       unsigned int workers, struct tpool_loop loop,
+		       tpool_range_fn fn, void *ctx)
+{
+	struct tpool_team team;
+	struct tpool_parallel_for pf = {begin, end, loop, fn, ctx};
+
+	if (workers == 0)
+		workers = t->cfg.threads_max + 1;
+	if (end <= begin)
+		return 0;
+	if (end - begin < workers)
+		workers = (unsigned int)(end - begin);
+
+	// Team run waits for all members already.
+	pf.loop.nowait = true;
+	return tpool_team_run(t, &team, workers, tpool_parallel_for_member,
+			      &pf);
+}
+
+/**
+ * Enters a serial stage. If stage is busy or, except for input stage, token
+ * isn't next in order, token is parked and false is returned.
+ */
+static bool tpool_stage_enter(struct tpool_pipeline_stage *stage,
+			      struct tpool_pipeline_token *tok)
+{
+	if (tok->owner) {
+		tok->owner = false;
+		return true;
+	}
+
+	pthread_mutex_lock(&stage->mu);
+	if (!stage->busy && (tok->stage == 0 || tok->ticket == stage->next)) {
+		stage->busy = true;
+		pthread_mutex_unlock(&stage->mu);
+		return true;
+	}
+
+	struct tpool_pipeline_token **prev = &stage->parked;
+	while (tok->stage != 0 && *prev != NULL &&
+	       (*prev)->ticket < tok->ticket)
+		prev = &(*prev)->next;
+	tok->next = *prev;
+	*prev = tok;
+	pthread_mutex_unlock(&stage->mu);
+	return false;
+}
+
+/**
+ * Leaves a serial stage and hands it over to next parked token, if it can
+ * enter.
+ */
+static void tpool_stage_leave(struct tpool_pipeline *p,
+			      struct tpool_pipeline_stage *stage)
+{
+	struct tpool_pipeline_token *tok;
+
+	pthread_mutex_lock(&stage->mu);
+	stage->next++;
+	tok = stage->parked;
+	if (tok != NULL && (tok->stage == 0 || tok->ticket == stage->next)) {
+		stage->parked = tok->next;
+		tok->owner = true;
+	} else {
+		stage->busy = false;
+		tok = NULL;
+	}
+	pthread_mutex_unlock(&stage->mu);
+
+	if (tok != NULL)
+		tpool_schedule(p->pool, tpool_batch_from_task(&tok->task));
+}
+
+/**
+ * Task moving a token through pipeline stages until input is exhausted.
+ */
+static void tpool_pipeline_token_work(struct tpool_task *task)
+{
+	struct tpool_pipeline_token *tok = (struct tpool_pipeline_token *)task;
+	struct tpool_pipeline *p = tok->pipeline;
+
+	while (1) {
+		struct tpool_pipeline_stage *stage = &p->stages[tok->stage];
+		bool serial =
+		    tok->stage == 0 || stage->mode == TPOOL_STAGE_SERIAL;
+
+		if (serial && !tpool_stage_enter(stage, tok))
+			return;
+
+		if (tok->stage == 0) {
+			if (!p->eof && (*stage->fn)(stage->ctx, tok))
+				tok->ticket = stage->next;
+			else
+				p->eof = true;
+			bool eof = p->eof;
+			tpool_stage_leave(p, stage);
+			if (eof) {
+				tpool_join_done(&p->join);
+				return;
+			}
+		} else {
+			(*stage->fn)(stage->ctx, tok);
+			if (serial)
+				tpool_stage_leave(p, stage);
+		}
+
+		tok->stage = (tok->stage + 1) % p->stages_len;
+	}
+}
+
+void tpool_pipeline_run(struct tpool *t, struct tpool_pipeline_stage *stages,
+			unsigned int stages_len,
+			struct tpool_pipeline_token *tokens,
+			unsigned int tokens_len)
+{
+	struct tpool_pipeline p = {
+	    .pool = t,
+	    .stages = stages,
+	    .stages_len = stages_len,
+	    .eof = false,
+	};
+	struct tpool_batch b = {0};
+
+	if (stages_len == 0 || tokens_len == 0)
+		return;
+
+	for (unsigned int i = 0; i < stages_len; i++) {
+		pthread_mutex_init(&stages[i].mu, NULL);
+		stages[i].next = 0;
+		stages[i].busy = false;
+		stages[i].parked = NULL;
+	}
+
+	tpool_join_init(&p.join);
+	for (unsigned int i = 0; i < tokens_len; i++) {
+		struct tpool_pipeline_token *tok = &tokens[i];
+		tok->task.work = tpool_pipeline_token_work;
+		tok->pipeline = &p;
+		tok->next = NULL;
+		tok->id = i;
+		tok->stage = 0;
+		tok->ticket = 0;
+		tok->owner = false;
+		tok->item = NULL;
+		tpool_batch_push(&b, tpool_batch_from_task(&tok->task));
+	}
+
+	atomic_fetch_add(&p.join.pending, tokens_len);
+	tpool_schedule(t, b);
+	tpool_join_wait(t, &p.join);
+
+	for (unsigned int i = 0; i < stages_len; i++)
+		pthread_mutex_destroy(&stages[i].mu);
+}
+
+/**
+ * State of a file scan.
+ */
+struct tpool_file {
+	const char *data;
+	size_t size;
+	size_t offset;
+	unsigned long index;
+	struct tpool_file_config scan;
+	struct tpool_file_chunk chunks[TPOOL_FILE_TOKENS];
+};
+
+/**
+ * Input stage of a file scan. memchr() is used to find chunk boundaries as it
+ * is vectorized by libc.
+ */
+static bool tpool_file_input(void *ctx, struct tpool_pipeline_token *tok)
+{
+	struct tpool_file *f = ctx;
+	struct tpool_file_chunk *c = &f->chunks[tok->id];
+
+	if (f->offset == f->size)
+		return false;
+
+	size_t end = f->size;
+	if (f->size - f->offset > f->scan.chunk_size) {
+		end = f->offset + f->scan.chunk_size;
+		const char *d =
+		    memchr(f->data + end, f->scan.delimiter, f->size - end);
+		end = d == NULL ? f->size : (size_t)(d - f->data) + 1;
+	}
+
+	c->data = f->data + f->offset;
+	c->len = end - f->offset;
+	c->offset = f->offset;
+	c->index = f->index++;
+	c->slot = tok->id;
+	tok->item = c;
+	f->offset = end;
+	return true;
+}
+
+static bool tpool_file_process(void *ctx, struct tpool_pipeline_token *tok)
+{
+	struct tpool_file *f = ctx;
+	(*f->scan.process)(f->scan.ctx, tok->item);
+	return true;
+}
+
+static bool tpool_file_merge(void *ctx, struct tpool_pipeline_token *tok)
+{
+	struct tpool_file *f = ctx;
+	(*f->scan.merge)(f->scan.ctx, tok->item);
+	return true;
+}
+
+int tpool_file_scan(struct tpool *t, const char *path,
+		    struct tpool_file_config scan)
+{
+	struct tpool_file f = {.scan = scan};
+	struct tpool_pipeline_token tokens[TPOOL_FILE_TOKENS];
+	struct tpool_pipeline_stage stages[] = {
+	    {.fn = tpool_file_input, .ctx = &f},
+	    {.mode = TPOOL_STAGE_PARALLEL, .fn = tpool_file_process, .ctx = &f},
+	    {.mode = TPOOL_STAGE_SERIAL, .fn = tpool_file_merge, .ctx = &f},
+	};
+	struct stat st;
+	void *data;
+	int fd, err = 0;
+
+	if (f.scan.chunk_size == 0)
+		f.scan.chunk_size = TPOOL_DEFAULT_FILE_CHUNK;
+	if (f.scan.delimiter == 0)
+		f.scan.delimiter = '\n';
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) < 0) {
+		err = -errno;
+		goto out;
+	}
+	if (st.st_size == 0)
+		goto out;
+
+	f.size = (size_t)st.st_size;
+	data = mmap(NULL, f.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		err = -errno;
+		goto out;
+	}
+	f.data = data;
+#ifdef POSIX_MADV_SEQUENTIAL
+	posix_madvise(data, f.size, POSIX_MADV_SEQUENTIAL);
+#endif
+
+	// Two chunks in flight per thread keep all of them busy while input
+	// and merge stages are running.
+	unsigned int tokens_len = 2 * (t->cfg.threads_max + 1);
+	if (tokens_len > TPOOL_FILE_TOKENS)
+		tokens_len = TPOOL_FILE_TOKENS;
+	tpool_pipeline_run(t, stages, scan.merge != NULL ? 3 : 2, tokens,
+			   tokens_len);
+
+	munmap(data, f.size);
+out:
+	close(fd);
+	return err;
+}
+
+/**
+ * Chained hash table of a partition. Initial buckets are part of the
+ * MapReduce's bucket block, grown ones are allocated separately.
+ */
+struct tpool_mr_table {
+	struct tpool_mr_entry **buckets;
+	size_t mask;
+	size_t len;
+	bool grown;
+};
+
+struct tpool_mr_shard {
+	struct tpool_mr *mr;
+	struct tpool_mr_table *tables;
+};
+
+/**
+ * State of a MapReduce. Member i emits in shard i, with one table per
+ * partition.
+ */
+struct tpool_mr {
+	struct tpool_mr_config cfg;
+	size_t begin;
+	size_t end;
+	unsigned int size;
+	struct tpool_mr_shard *shards;
+};
+
+/**
+ * Doubles table's buckets count. Table keeps its buckets if allocation fails,
+ * chains are just longer.
+ */
+static void tpool_mr_grow(struct tpool_mr *mr, struct tpool_mr_table *tb)
+{
+	size_t n = 2 * (tb->mask + 1);
+	struct tpool_mr_entry **buckets = calloc(n, sizeof(*buckets));
+	if (buckets == NULL)
+		return;
+
+	for (size_t i = 0; i <= tb->mask; i++) {
+		struct tpool_mr_entry *e = tb->buckets[i], *next;
+		for (; e != NULL; e = next) {
+			next = e->next;
+			size_t h = (size_t)(e->hash / mr->cfg.partitions);
+			e->next = buckets[h & (n - 1)];
+			buckets[h & (n - 1)] = e;
+		}
+	}
+
+	if (tb->grown)
+		free(tb->buckets);
+	tb->buckets = buckets;
+	tb->mask = n - 1;
+	tb->grown = true;
+}
+
+/**
+ * Inserts an entry in table or combines it with entry of the same key.
+ */
+static void tpool_mr_insert(struct tpool_mr *mr, struct tpool_mr_table *tb,
+			    struct tpool_mr_entry *e)
+{
+	// Partition is selected with low part of the hash, bucket with the
+	// rest.
+	size_t h = (size_t)(e->hash / mr->cfg.partitions);
+	struct tpool_mr_entry **b = &tb->buckets[h & tb->mask];
+
+	for (struct tpool_mr_entry *o = *b; o != NULL; o = o->next) {
+		if (o->hash == e->hash && (*mr->cfg.eq)(mr->cfg.ctx, o, e)) {
+			(*mr->cfg.combine)(mr->cfg.ctx, o, e);
+			return;
+		}
+	}
+
+	e->next = *b;
+	*b = e;
+	if (++tb->len > 2 * (tb->mask + 1))
+		tpool_mr_grow(mr, tb);
+}
+
+void tpool_mr_emit(struct tpool_mr_shard *s, struct tpool_mr_entry *e)
+{
+	struct tpool_mr *mr = s->mr;
+	tpool_mr_insert(mr, &s->tables[e->hash % mr->cfg.partitions], e);
+}
+
+static void tpool_mr_map(void *ctx, size_t begin, size_t end)
+{
+	struct tpool_mr_shard *s = ctx;
+	(*s->mr->cfg.map)(s->mr->cfg.ctx, s, begin, end);
+}
+
+/**
+ * Merges partitions [begin, end) of all shards into first shard and reduces
+ * them.
+ */
+static void tpool_mr_reduce(void *ctx, size_t begin, size_t end)
+{
+	struct tpool_mr *mr = ctx;
+
+	for (size_t p = begin; p < end; p++) {
+		struct tpool_mr_table *dst = &mr->shards[0].tables[p];
+
+		for (unsigned int i = 1; i < mr->size; i++) {
+			struct tpool_mr_table *src = &mr->shards[i].tables[p];
+			for (size_t j = 0; j <= src->mask; j++) {
+				struct tpool_mr_entry *e = src->buckets[j];
+				struct tpool_mr_entry *next;
+				for (; e != NULL; e = next) {
+					next = e->next;
+					tpool_mr_insert(mr, dst, e);
+				}
+			}
+		}
+
+		for (size_t j = 0; j <= dst->mask; j++) {
+			struct tpool_mr_entry *e = dst->buckets[j], *next;
+			for (; e != NULL; e = next) {
+				next = e->next;
+				(*mr->cfg.reduce)(mr->cfg.ctx, e);
+			}
+		}
+	}
+}
+
+static void tpool_mr_member(struct tpool_team_member *m, void *ptr)
+{
+	struct tpool_mr *mr = ptr;
+
+	// Map loop ends with a barrier so that all shards are complete before
+	// merge starts.
+	tpool_team_for(m, mr->begin, mr->end, mr->cfg.loop, tpool_mr_map,
+		       &mr->shards[m->id]);
+	tpool_team_for(m, 0, mr->cfg.partitions,
+		       (struct tpool_loop){.schedule = TPOOL_LOOP_GUIDED,
+					   .chunk = 1,
+					   .nowait = true},
+		       tpool_mr_reduce, mr);
+}
+
+int tpool_mapreduce(struct tpool *t, size_t begin, size_t end,
+		    struct tpool_mr_config cfg)
+{
+	struct tpool_mr mr = {.cfg = cfg, .begin = begin, .end = end};
+	struct tpool_team team;
+	struct tpool_mr_table *tables;
+	struct tpool_mr_entry **buckets;
+	int err;
+
+	// Same clamping as tpool_team_run() so there is a shard per member,
+	// team may still be smaller when started on a pool thread.
+	mr.size = cfg.workers == 0 ? t->cfg.threads_max + 1 : cfg.workers;
+	if (mr.size > TPOOL_TEAM_MAX)
+		mr.size = TPOOL_TEAM_MAX;
+	if (mr.size > t->cfg.threads_max + 1)
+		mr.size = t->cfg.threads_max + 1;
+	if (mr.cfg.partitions == 0)
+		mr.cfg.partitions = 2 * mr.size;
+	mr.cfg.loop.nowait = false;
+
+	size_t n = (size_t)mr.size * mr.cfg.partitions;
+	mr.shards = calloc(mr.size, sizeof(*mr.shards));
+	tables = calloc(n, sizeof(*tables));
+	buckets = calloc(n * TPOOL_MR_BUCKETS, sizeof(*buckets));
+	if (mr.shards == NULL || tables == NULL || buckets == NULL) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		tables[i].buckets = &buckets[i * TPOOL_MR_BUCKETS];
+		tables[i].mask = TPOOL_MR_BUCKETS - 1;
+	}
+	for (unsigned int i = 0; i < mr.size; i++) {
+		mr.shards[i].mr = &mr;
+		mr.shards[i].tables = &tables[i * mr.cfg.partitions];
+	}
+
+	err = tpool_team_run(t, &team, mr.size, tpool_mr_member, &mr);
+	if (err > 0)
+		err = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		if (tables[i].grown)
+			free(tables[i].buckets);
+	}
+
+out:
+	free(buckets);
+	free(tables);
+	free(mr.shards);
+	return err;
+}
+
+/**
+ * Tiled iteration space shared by tasks of a multidimensional loop. Cells are
+ * tile coordinates.
+ */
+struct tpool_grid {
+	struct tpool *pool;
+	struct tpool_box box;
+	size_t tile[3];
+	size_t tiles[3];
+	unsigned int dims;
+	tpool_box_fn fn;
+	void *ctx;
+};
+
+static void tpool_grid_visit(const struct tpool_grid *g, const size_t cell[3])
+{
+	struct tpool_box b;
+	for (unsigned int d = 0; d < 3; d++) {
+		b.begin[d] = g->box.begin[d] + cell[d] * g->tile[d];
+		b.end[d] = b.begin[d] + g->tile[d];
+		if (b.end[d] > g->box.end[d])
+			b.end[d] = g->box.end[d];
+	}
+	(*g->fn)(g->ctx, &b);
+}
+
+/**
+ * Half of a grid forked by recursive bisection, cells [lo, hi).
+ */
+struct tpool_grid_split {
+	struct tpool_task task;
+	struct tpool_join *join;
+	const struct tpool_grid *grid;
+	size_t lo[3];
+	size_t hi[3];
+};
+
+static void tpool_grid_split_run(const struct tpool_grid *g,
+				 const size_t lo[3], const size_t hi[3]);
+
+static void tpool_grid_split_work(struct tpool_task *task)
+{
+	struct tpool_grid_split *s = (struct tpool_grid_split *)task;
+	tpool_grid_split_run(s->grid, s->lo, s->hi);
+	tpool_join_done(s->join);
+}
+
+static void tpool_grid_split_run(const struct tpool_grid *g,
+				 const size_t lo[3], const size_t hi[3])
+{
+	struct tpool_join join;
+	struct tpool_grid_split half;
+	size_t rest[3];
+	unsigned int d = 0;
+
+	for (unsigned int i = 1; i < 3; i++)
+		if (hi[i] - lo[i] > hi[d] - lo[d])
+			d = i;
+	if (hi[d] - lo[d] == 1) {
+		tpool_grid_visit(g, lo);
+		return;
+	}
+
+	// Fork first half along longest dimension, execute second one.
+	tpool_join_init(&join);
+	half.task.work = tpool_grid_split_work;
+	half.join = &join;
+	half.grid = g;
+	for (unsigned int i = 0; i < 3; i++) {
+		half.lo[i] = lo[i];
+		half.hi[i] = hi[i];
+		rest[i] = lo[i];
+	}
+	half.hi[d] = lo[d] + (hi[d] - lo[d]) / 2;
+	rest[d] = half.hi[d];
+
+	tpool_fork(g->pool, &join, &half.task);
+	tpool_grid_split_run(g, rest, hi);
+	tpool_join_wait(g->pool, &join);
+}
+
+/**
+ * Node of a space filling curve over a power of two sided cube of cells.
+ * Local coordinates l in [0, side) map to cell origin + axes * l.
+ */
+struct tpool_grid_node {
+	struct tpool_task task;
+	struct tpool_join *join;
+	const struct tpool_grid *grid;
+	enum tpool_tile_order order;
+	long origin[3];
+	signed char axes[3][3];
+	size_t side;
+};
+
+/**
+ * Reports whether node intersects grid.
+ */
+static bool tpool_grid_node_visible(const struct tpool_grid_node *n)
+{
+	for (unsigned int d = 0; d < n->grid->dims; d++) {
+		long a = n->origin[d], b = n->origin[d];
+		for (unsigned int k = 0; k < n->grid->dims; k++)
+			b += n->axes[d][k] * (long)(n->side - 1);
+		long lo = a < b ? a : b, hi = a < b ? b : a;
+		if (hi < 0 || lo >= (long)n->grid->tiles[d])
+			return false;
+	}
+	return true;
+}
+
+/**
+ * Initializes i-th child of node in curve order.
+ */
+static void tpool_grid_node_child(const struct tpool_grid_node *n,
+				  unsigned int i, struct tpool_grid_node *child)
+{
+	long h = (long)n->side / 2;
+	long q[3] = {i & 1, (i >> 1) & 1, (i >> 2) & 1};
+	long off[3] = {0, 0, 0};
+	signed char c[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+
+	// Hilbert curve visits quadrants (0,0), (0,1), (1,1) and (1,0), first
+	// one transposed and last one anti-transposed so curve is continuous.
+	if (n->order == TPOOL_TILE_HILBERT) {
+		q[0] = i >= 2;
+		q[1] = i == 1 || i == 2;
+		if (i == 0 || i == 3) {
+			signed char s = i == 0 ? 1 : -1;
+			c[0][0] = c[1][1] = 0;
+			c[0][1] = c[1][0] = s;
+		}
+		if (i == 3)
+			off[0] = off[1] = h - 1;
+	}
+
+	*child = *n;
+	child->side = (size_t)h;
+	for (unsigned int d = 0; d < 3; d++) {
+		for (unsigned int k = 0; k < 3; k++) {
+			child->origin[d] += n->axes[d][k] * (q[k] * h + off[k]);
+
+			int a = 0;
+			for (unsigned int j = 0; j < 3; j++)
+				a += n->axes[d][j] * c[j][k];
+			child->axes[d][k] = (signed char)a;
+		}
+	}
+}
+
+static void tpool_grid_node_run(const struct tpool_grid_node *n);
+
+static void tpool_grid_node_work(struct tpool_task *task)
+{
+	struct tpool_grid_node *n = (struct tpool_grid_node *)task;
+	tpool_grid_node_run(n);
+	tpool_join_done(n->join);
+}
+
+static void tpool_grid_node_run(const struct tpool_grid_node *n)
+{
+	struct tpool_grid_node children[8];
+	struct tpool_join join;
+	unsigned int count = n->order == TPOOL_TILE_HILBERT
+				 ? 4
+				 : 1u << n->grid->dims;
+
+	if (n->side == 1) {
+		size_t cell[3] = {0, 0, 0};
+		for (unsigned int d = 0; d < n->grid->dims; d++)
+			cell[d] = (size_t)n->origin[d];
+		tpool_grid_visit(n->grid, cell);
+		return;
+	}
+
+	// Fork visible children but the first one which is executed inline.
+	tpool_join_init(&join);
+	for (unsigned int i = 0; i < count; i++) {
+		tpool_grid_node_child(n, i, &children[i]);
+		children[i].task.work = tpool_grid_node_work;
+		children[i].join = &join;
+		if (i > 0 && tpool_grid_node_visible(&children[i]))
+			tpool_fork(n->grid->pool, &join, &children[i].task);
+	}
+
+	if (tpool_grid_node_visible(&children[0]))
+		tpool_grid_node_run(&children[0]);
+	tpool_join_wait(n->grid->pool, &join);
+}
+
+static void tpool_parallel_for_nd(struct tpool *t, struct tpool_box box,
+				  struct tpool_tiling tiling, unsigned int dims,
+				  tpool_box_fn fn, void *ctx)
+{
+	struct tpool_grid g;
+	size_t side = 1;
+
+	if (dims == 2) {
+		box.begin[2] = 0;
+		box.end[2] = 1;
+		tiling.tile[2] = 1;
+	} else if (tiling.order == TPOOL_TILE_HILBERT) {
+		tiling.order = TPOOL_TILE_MORTON;
+	}
+
+	g.pool = t;
+	g.box = box;
+	g.dims = dims;
+	g.fn = fn;
+	g.ctx = ctx;
+	for (unsigned int d = 0; d < 3; d++) {
+		g.tile[d] =
+		    tiling.tile[d] == 0 ? TPOOL_DEFAULT_TILE : tiling.tile[d];
+		if (box.end[d] <= box.begin[d])
+			return;
+		g.tiles[d] = (box.end[d] - box.begin[d] + g.tile[d] - 1) /
+			     g.tile[d];
+		while (side < g.tiles[d])
+			side *= 2;
+	}
+
+	switch (tiling.order) {
+	case TPOOL_TILE_SPLIT: {
+		size_t lo[3] = {0, 0, 0};
+		tpool_grid_split_run(&g, lo, g.tiles);
+		break;
+	}
+	case TPOOL_TILE_MORTON:
+	case TPOOL_TILE_HILBERT: {
+		struct tpool_grid_node root = {
+		    .grid = &g,
+		    .order = tiling.order,
+		    .axes = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}},
+		    .side = side,
+		};
+		tpool_grid_node_run(&root);
+		break;
+	}
+	}
+}
+
+void tpool_parallel_for_2d(struct tpool *t, struct tpool_box box,
+			   struct tpool_tiling tiling, tpool_box_fn fn,
+			   void *ctx)
+{
+	tpool_parallel_for_nd(t, box, tiling, 2, fn, ctx);
+}
+
+void tpool_parallel_for_3d(struct tpool *t, struct tpool_box box,
+			   struct tpool_tiling tiling, tpool_box_fn fn,
+			   void *ctx)
+{
+	tpool_parallel_for_nd(t, box, tiling, 3, fn, ctx);
 }
 
 #endif /* THREADPOOL_IMPLEMENTATION */
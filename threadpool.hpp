@@ -0,0 +1,2013 @@
+/**
+ * C++17 wrapper of threadpool.h. Tasks are any move-only callable, stored in
+ * recycled one cache line task objects so submitting a small lambda doesn't
+ * allocate. Larger callables and coroutine frames are allocated from a
+ * std::pmr::memory_resource, recycling_resource() by default. Coroutines and
+ * P2300 senders support is enabled when compiling as C++20.
+ * threadpool.h implementation must be compiled in a C translation unit.
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 Alexandre Negrel
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef THREADPOOL_HPP_INCLUDE
+#define THREADPOOL_HPP_INCLUDE
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#include <variant>
+#define TPOOL_COROUTINES 1
+#endif
+
+#if __cplusplus >= 202002L
+#define TPOOL_SENDERS 1
+#endif
+
+#include "threadpool.h"
+
+#ifndef TPOOL_TASK_CACHE
+#define TPOOL_TASK_CACHE 64
+#endif /* TPOOL_TASK_CACHE */
+
+#ifndef TPOOL_RECYCLE_CACHE
+#define TPOOL_RECYCLE_CACHE 32
+#endif /* TPOOL_RECYCLE_CACHE */
+
+#ifndef TPOOL_PAR_SORT_CUTOFF
+#define TPOOL_PAR_SORT_CUTOFF 4096
+#endif /* TPOOL_PAR_SORT_CUTOFF */
+
+namespace threadpool {
+
+namespace detail {
+
+/**
+ * Task object, a tpool_task header followed by inline storage for the
+ * callable, or a pointer to it if it doesn't fit.
+ */
+struct alignas(64) task_block {
+	static constexpr std::size_t storage_size = 64 - sizeof(tpool_task);
+
+	tpool_task task;
+	alignas(std::max_align_t) unsigned char storage[storage_size];
+};
+
+static_assert(sizeof(task_block) == 64, "task object must fit a cache line");
+static_assert(offsetof(task_block, task) == 0,
+	      "task header must be first for tpool_task casts");
+
+template <class Fn>
+inline constexpr bool fits_inline =
+    sizeof(Fn) <= task_block::storage_size &&
+    alignof(Fn) <= alignof(std::max_align_t) &&
+    std::is_nothrow_move_constructible_v<Fn>;
+
+/**
+ * Free task objects shared by all threads, linked through their header.
+ * Threads exchange half a cache at a time with it.
+ */
+struct depot {
+	std::mutex mu;
+	tpool_task *head = nullptr;
+	std::size_t len = 0;
+};
+
+/**
+ * Depot is never destroyed: pool threads flush their cache on exit, which
+ * may happen after static destructors ran.
+ */
+inline depot &global_depot()
+{
+	static depot *d = new depot;
+	return *d;
+}
+
+/**
+ * Per thread cache of free task objects. Tasks are usually released on a
+ * different thread than the one that acquired them, so caches overflowing
+ * on workers refill caches of submitting threads through the depot.
+ */
+class task_cache {
+	tpool_task *head_ = nullptr;
+	std::size_t len_ = 0;
+
+	void spill(std::size_t n)
+	{
+		if (n == 0)
+			return;
+
+		tpool_task *first = head_, *last = head_;
+		for (std::size_t i = 1; i < n; i++)
+			last = last->next;
+		head_ = last->next;
+		len_ -= n;
+
+		depot &d = global_depot();
+		std::lock_guard<std::mutex> lock(d.mu);
+		last->next = d.head;
+		d.head = first;
+		d.len += n;
+	}
+
+	void refill()
+	{
+		depot &d = global_depot();
+		std::lock_guard<std::mutex> lock(d.mu);
+		while (d.head != nullptr && len_ < TPOOL_TASK_CACHE / 2) {
+			tpool_task *t = d.head;
+			d.head = t->next;
+			d.len--;
+			t->next = head_;
+			head_ = t;
+			len_++;
+		}
+	}
+
+public:
+	task_cache() = default;
+	task_cache(const task_cache &) = delete;
+	task_cache &operator=(const task_cache &) = delete;
+
+	~task_cache() { spill(len_); }
+
+	task_block *acquire()
+	{
+		if (head_ == nullptr)
+			refill();
+		if (head_ == nullptr)
+			return new task_block;
+
+		tpool_task *t = head_;
+		head_ = t->next;
+		len_--;
+		return reinterpret_cast<task_block *>(t);
+	}
+
+	void release(task_block *b)
+	{
+		b->task.next = head_;
+		head_ = &b->task;
+		if (++len_ > TPOOL_TASK_CACHE)
+			spill(TPOOL_TASK_CACHE / 2);
+	}
+};
+
+inline task_cache &local_cache()
+{
+	thread_local task_cache cache;
+	return cache;
+}
+
+/**
+ * Size classes of recycled blocks, multiples of a cache line up to 1 KiB.
+ */
+struct recycle_class {
+	static constexpr std::size_t granule = 64;
+	static constexpr std::size_t count = 16;
+
+	static std::size_t of(std::size_t size) noexcept
+	{
+		return size == 0 ? 0 : (size - 1) / granule;
+	}
+};
+
+struct free_block {
+	free_block *next;
+};
+
+/**
+ * Free blocks of a size class shared by all threads. Never destroyed, for the
+ * same reason as the task depot.
+ */
+struct block_depot {
+	std::mutex mu;
+	free_block *head = nullptr;
+};
+
+inline block_depot *block_depots()
+{
+	static block_depot *d = new block_depot[recycle_class::count];
+	return d;
+}
+
+/**
+ * Per thread cache of free blocks of each size class. As with task_cache,
+ * blocks are exchanged with depots half a cache at a time so blocks freed by
+ * workers flow back to submitting threads.
+ */
+class block_cache {
+	free_block *free_[recycle_class::count] = {};
+	std::size_t len_[recycle_class::count] = {};
+
+	void spill(std::size_t c, std::size_t n)
+	{
+		if (n == 0)
+			return;
+
+		free_block *first = free_[c], *last = free_[c];
+		for (std::size_t i = 1; i < n; i++)
+			last = last->next;
+		free_[c] = last->next;
+		len_[c] -= n;
+
+		block_depot &d = block_depots()[c];
+		std::lock_guard<std::mutex> lock(d.mu);
+		last->next = d.head;
+		d.head = first;
+	}
+
+	void refill(std::size_t c)
+	{
+		block_depot &d = block_depots()[c];
+		std::lock_guard<std::mutex> lock(d.mu);
+		while (d.head != nullptr && len_[c] < TPOOL_RECYCLE_CACHE / 2) {
+			free_block *b = d.head;
+			d.head = b->next;
+			b->next = free_[c];
+			free_[c] = b;
+			len_[c]++;
+		}
+	}
+
+public:
+	block_cache() = default;
+	block_cache(const block_cache &) = delete;
+	block_cache &operator=(const block_cache &) = delete;
+
+	~block_cache()
+	{
+		for (std::size_t c = 0; c < recycle_class::count; c++)
+			spill(c, len_[c]);
+	}
+
+	void *allocate(std::size_t c)
+	{
+		if (free_[c] == nullptr)
+			refill(c);
+		if (free_[c] == nullptr)
+			return ::operator new((c + 1) * recycle_class::granule);
+
+		free_block *b = free_[c];
+		free_[c] = b->next;
+		len_[c]--;
+		return b;
+	}
+
+	void deallocate(void *p, std::size_t c) noexcept
+	{
+		free_block *b = static_cast<free_block *>(p);
+		b->next = free_[c];
+		free_[c] = b;
+		if (++len_[c] > TPOOL_RECYCLE_CACHE)
+			spill(c, TPOOL_RECYCLE_CACHE / 2);
+	}
+};
+
+inline block_cache &local_blocks()
+{
+	thread_local block_cache cache;
+	return cache;
+}
+
+/**
+ * Memory resource recycling blocks of up to 1 KiB through per thread caches,
+ * larger or over-aligned blocks are forwarded to operator new.
+ */
+class recycler final : public std::pmr::memory_resource {
+	static bool recycled(std::size_t bytes, std::size_t alignment) noexcept
+	{
+		return alignment <= alignof(std::max_align_t) &&
+		       recycle_class::of(bytes) < recycle_class::count;
+	}
+
+	void *do_allocate(std::size_t bytes, std::size_t alignment) override
+	{
+		if (recycled(bytes, alignment))
+			return local_blocks().allocate(
+			    recycle_class::of(bytes));
+		return ::operator new(bytes, std::align_val_t(alignment));
+	}
+
+	void do_deallocate(void *p, std::size_t bytes,
+			   std::size_t alignment) override
+	{
+		if (recycled(bytes, alignment))
+			local_blocks().deallocate(p, recycle_class::of(bytes));
+		else
+			::operator delete(p, bytes,
+					  std::align_val_t(alignment));
+	}
+
+	bool do_is_equal(const memory_resource &o) const noexcept override
+	{
+		return this == &o;
+	}
+};
+
+} // namespace detail
+
+/**
+ * Returns the process wide recycling resource, safe to use from any thread.
+ * Steady state allocations of a given size don't reach operator new.
+ */
+inline std::pmr::memory_resource *recycling_resource() noexcept
+{
+	static detail::recycler *r = new detail::recycler;
+	return r;
+}
+
+namespace detail {
+
+/**
+ * Callable that doesn't fit inline, and the resource it was allocated from.
+ */
+template <class Fn> struct stored_ref {
+	Fn *fn;
+	std::pmr::memory_resource *mr;
+};
+
+/**
+ * Returns callable of type Fn stored in a task object.
+ */
+template <class Fn> Fn *stored(task_block *b) noexcept
+{
+	if constexpr (fits_inline<Fn>)
+		return std::launder(reinterpret_cast<Fn *>(b->storage));
+	else
+		return std::launder(
+			   reinterpret_cast<stored_ref<Fn> *>(b->storage))
+		    ->fn;
+}
+
+template <class Fn> void destroy_stored(task_block *b) noexcept
+{
+	if constexpr (fits_inline<Fn>) {
+		stored<Fn>(b)->~Fn();
+	} else {
+		auto *ref = std::launder(
+		    reinterpret_cast<stored_ref<Fn> *>(b->storage));
+		ref->fn->~Fn();
+		ref->mr->deallocate(ref->fn, sizeof(Fn), alignof(Fn));
+	}
+}
+
+/**
+ * Work function of a task storing a callable of type Fn. Callable is
+ * destroyed and task object recycled before returning. Exceptions can't
+ * cross the C pool and terminate the program.
+ */
+template <class Fn> void task_work(tpool_task *task) noexcept
+{
+	task_block *b = reinterpret_cast<task_block *>(task);
+
+	(*stored<Fn>(b))();
+	destroy_stored<Fn>(b);
+	local_cache().release(b);
+}
+
+/**
+ * Task header of objects embedding a task. They derive from it so their task
+ * can be cast back whatever their other members are.
+ */
+struct task_base {
+	tpool_task task{};
+};
+
+using index_range = std::pair<std::size_t, std::size_t>;
+
+/**
+ * Splits a range of indexes in halves, see fork_join().
+ */
+inline std::optional<std::pair<index_range, index_range>>
+halves(const index_range &r)
+{
+	if (r.second - r.first < 2)
+		return std::nullopt;
+	std::size_t mid = r.first + (r.second - r.first) / 2;
+	return std::pair<index_range, index_range>{{r.first, mid},
+						   {mid, r.second}};
+}
+
+/**
+ * Stores a callable in a recycled task object, allocating it from `mr` if it
+ * doesn't fit inline. `mr` must allow deallocation from pool threads. `work`
+ * must destroy the callable and release the task object, as task_work() does.
+ */
+template <class F, class Fn = std::decay_t<F>>
+tpool_task *make_task(F &&f, tpool_work_fn work = &task_work<Fn>,
+		      std::pmr::memory_resource *mr = recycling_resource())
+{
+	static_assert(std::is_invocable_v<Fn &>, "task must be callable");
+
+	task_block *b = local_cache().acquire();
+	try {
+		if constexpr (fits_inline<Fn>) {
+			::new (static_cast<void *>(b->storage))
+			    Fn(std::forward<F>(f));
+		} else {
+			std::pmr::polymorphic_allocator<Fn> alloc(mr);
+			Fn *fn = alloc.allocate(1);
+			try {
+				::new (static_cast<void *>(fn))
+				    Fn(std::forward<F>(f));
+			} catch (...) {
+				alloc.deallocate(fn, 1);
+				throw;
+			}
+			::new (static_cast<void *>(b->storage))
+			    stored_ref<Fn>{fn, mr};
+		}
+	} catch (...) {
+		local_cache().release(b);
+		throw;
+	}
+	b->task.work = work;
+	return &b->task;
+}
+
+} // namespace detail
+
+#ifdef TPOOL_COROUTINES
+
+/**
+ * Awaitable moving a coroutine to a thread of the pool. The task is embedded
+ * in the awaiter, which lives in the coroutine frame, so hopping onto the pool
+ * doesn't allocate. Coroutines already running on the pool continue inline.
+ */
+class schedule_awaiter {
+	tpool_task task_{};
+	tpool *pool_;
+	std::coroutine_handle<> handle_;
+
+	static void work(tpool_task *task) noexcept
+	{
+		reinterpret_cast<schedule_awaiter *>(task)->handle_.resume();
+	}
+
+public:
+	explicit schedule_awaiter(tpool *t) noexcept : pool_(t) {}
+
+	bool await_ready() const noexcept { return tpool_current() == pool_; }
+
+	void await_suspend(std::coroutine_handle<> h) noexcept
+	{
+		handle_ = h;
+		task_.work = &work;
+		tpool_schedule(pool_, tpool_batch_from_task(&task_));
+	}
+
+	void await_resume() const noexcept {}
+};
+
+static_assert(std::is_standard_layout_v<schedule_awaiter>,
+	      "task header must be first for tpool_task casts");
+
+/**
+ * Awaitable suspending a coroutine until a future is set, resumes with its
+ * value. Coroutines suspended on a pool thread resume on that same thread,
+ * see tpool_resume_on().
+ */
+class future_awaiter {
+	tpool_task task_{};
+	tpool *pool_;
+	tpool_future *future_;
+	std::coroutine_handle<> handle_;
+
+	static void work(tpool_task *task) noexcept
+	{
+		reinterpret_cast<future_awaiter *>(task)->handle_.resume();
+	}
+
+public:
+	future_awaiter(tpool *t, tpool_future &f) noexcept
+	    : pool_(t), future_(&f)
+	{
+	}
+
+	bool await_ready() const noexcept
+	{
+		return tpool_future_ready(future_);
+	}
+
+	void await_suspend(std::coroutine_handle<> h) noexcept
+	{
+		handle_ = h;
+		task_.work = &work;
+		tpool_future_then(pool_, future_, &task_);
+	}
+
+	void *await_resume() const noexcept { return future_->value; }
+};
+
+static_assert(std::is_standard_layout_v<future_awaiter>,
+	      "task header must be first for tpool_task casts");
+
+#endif /* TPOOL_COROUTINES */
+
+#ifdef TPOOL_SENDERS
+
+template <class Problem, class Split, class Solve, class Combine>
+auto fork_join(tpool *t, Problem problem, Split split, Solve solve,
+	       Combine combine);
+
+class scheduler;
+
+namespace detail {
+
+/**
+ * Operation state of scheduler::schedule(), completes on a pool thread.
+ */
+template <class R> class schedule_op : task_base {
+	R r_;
+	tpool *pool_;
+
+	static void work(tpool_task *task) noexcept
+	{
+		auto *op = static_cast<schedule_op *>(
+		    reinterpret_cast<task_base *>(task));
+		std::move(op->r_).set_value();
+	}
+
+public:
+	schedule_op(tpool *t, R r) : r_(std::move(r)), pool_(t)
+	{
+		task.work = &work;
+	}
+
+	schedule_op(const schedule_op &) = delete;
+	schedule_op &operator=(const schedule_op &) = delete;
+
+	void start() & noexcept
+	{
+		tpool_schedule(pool_, tpool_batch_from_task(&task));
+	}
+};
+
+class schedule_sender {
+	tpool *pool_;
+
+public:
+	explicit schedule_sender(tpool *t) noexcept : pool_(t) {}
+
+	template <class R> schedule_op<R> connect(R r) const
+	{
+		return schedule_op<R>(pool_, std::move(r));
+	}
+
+	tpool *pool() const noexcept { return pool_; }
+};
+
+} // namespace detail
+
+/**
+ * P2300 scheduler of a pool. Operation states embed their task, so connecting
+ * and starting a schedule sender doesn't allocate.
+ */
+class scheduler {
+	tpool *pool_;
+
+public:
+	explicit scheduler(tpool *t) noexcept : pool_(t) {}
+
+	detail::schedule_sender schedule() const noexcept
+	{
+		return detail::schedule_sender(pool_);
+	}
+
+	bool operator==(const scheduler &) const noexcept = default;
+
+	tpool *native() const noexcept { return pool_; }
+};
+
+/**
+ * Sender calling `fn(i, values...)` for each i in [0, shape) on pool `t` once
+ * `sndr` completed with values, then forwarding them. Iterations are split
+ * with fork_join() rather than run as one task each, the completing thread
+ * executes forked halves while it waits so it may be the pool's only thread.
+ * First exception thrown by `fn` completes the sender with an error.
+ */
+template <class Sender, class Shape, class Fn> class bulk_sender {
+	tpool *pool_;
+	Sender sndr_;
+	Shape shape_;
+	Fn fn_;
+
+public:
+	template <class R> class op {
+		struct receiver {
+			op *o;
+
+			template <class... V>
+			void set_value(V &&...v) && noexcept
+			{
+				o->run(std::forward<V>(v)...);
+			}
+
+			template <class E> void set_error(E &&e) && noexcept
+			{
+				std::move(o->r_).set_error(std::forward<E>(e));
+			}
+
+			void set_stopped() && noexcept
+			{
+				std::move(o->r_).set_stopped();
+			}
+		};
+
+		tpool *pool_;
+		Shape shape_;
+		Fn fn_;
+		R r_;
+		decltype(std::declval<Sender>().connect(
+		    std::declval<receiver>())) inner_;
+		std::atomic<bool> failed_{false};
+		std::exception_ptr error_;
+
+		void fail() noexcept
+		{
+			if (!failed_.exchange(true))
+				error_ = std::current_exception();
+		}
+
+		template <class... V> void run(V &&...v) noexcept
+		{
+			auto body = [&](detail::index_range r) noexcept {
+				try {
+					for (size_t i = r.first; i < r.second;
+					     i++)
+						fn_(Shape(i), v...);
+				} catch (...) {
+					fail();
+				}
+				return true;
+			};
+
+			size_t n = static_cast<size_t>(shape_);
+			if (n > 0)
+				threadpool::fork_join(
+				    pool_, detail::index_range{0, n},
+				    &detail::halves, body,
+				    [](bool, bool) { return true; });
+
+			if (failed_)
+				std::move(r_).set_error(std::move(error_));
+			else
+				std::move(r_).set_value(std::forward<V>(v)...);
+		}
+
+	public:
+		op(tpool *t, Sender &&s, Shape shape, Fn &&fn, R &&r)
+		    : pool_(t), shape_(shape), fn_(std::move(fn)),
+		      r_(std::move(r)),
+		      inner_(std::move(s).connect(receiver{this}))
+		{
+		}
+
+		op(const op &) = delete;
+		op &operator=(const op &) = delete;
+
+		void start() & noexcept { inner_.start(); }
+	};
+
+	bulk_sender(tpool *t, Sender sndr, Shape shape, Fn fn)
+	    : pool_(t), sndr_(std::move(sndr)), shape_(shape),
+	      fn_(std::move(fn))
+	{
+	}
+
+	template <class R> op<R> connect(R r) &&
+	{
+		return op<R>(pool_, std::move(sndr_), shape_, std::move(fn_),
+			     std::move(r));
+	}
+
+	tpool *pool() const noexcept { return pool_; }
+};
+
+/**
+ * Bulk customization of the pool's senders, see bulk_sender.
+ */
+template <class Sender, std::integral Shape, class Fn>
+	requires requires(const Sender &s) {
+		{ s.pool() } -> std::same_as<tpool *>;
+	}
+bulk_sender<Sender, Shape, Fn> bulk(Sender sndr, Shape shape, Fn fn)
+{
+	tpool *t = sndr.pool();
+	return {t, std::move(sndr), shape, std::move(fn)};
+}
+
+#endif /* TPOOL_SENDERS */
+
+/**
+ * Compile time policies of basic_pool. Each policy belongs to a category, the
+ * first policy of a category in the list wins and missing categories use the
+ * defaults, which leave the config passed to constructor untouched. Queue and
+ * metrics policies are compiled into basic_pool, idle and lane policies only
+ * set the tpool_config fields the pool reads at runtime.
+ */
+namespace policy {
+
+struct queue_tag {};
+struct idle_tag {};
+struct metrics_tag {};
+struct lane_tag {};
+
+/**
+ * Each submitted task is scheduled right away.
+ */
+struct shared_queue {
+	using category = queue_tag;
+};
+
+/**
+ * Submitted tasks are buffered and scheduled N at a time, waking threads
+ * once per batch. Buffer is flushed early when threads need work, see
+ * tpool_want_fork(), which is checked on submit and once a submitted task is
+ * done. It is also flushed by flush(), wait_idle() and pool destruction.
+ */
+template <unsigned int N> struct batched_queue {
+	static_assert(N > 0, "batch size must be positive");
+	using category = queue_tag;
+	static constexpr unsigned int size = N;
+};
+
+/**
+ * Idle threads sleep on the pool condition variable, sets
+ * tpool_config.busy_poll.
+ */
+struct blocking_idle {
+	using category = idle_tag;
+	static constexpr bool busy_poll = false;
+};
+
+/**
+ * Idle threads spin on the queue, sets tpool_config.busy_poll.
+ */
+struct spinning_idle {
+	using category = idle_tag;
+	static constexpr bool busy_poll = true;
+};
+
+struct no_metrics {
+	using category = metrics_tag;
+};
+
+/**
+ * Counts submitted and completed tasks.
+ */
+struct counting_metrics {
+	using category = metrics_tag;
+};
+
+/**
+ * Removes submit_lane().
+ */
+struct no_lane {
+	using category = lane_tag;
+	static constexpr bool enabled = false;
+};
+
+/**
+ * Latency-critical lane served by `Threads` dedicated threads, sets
+ * tpool_config.lane_threads and lane_share.
+ */
+template <unsigned int Threads, bool Share = true> struct priority_lane {
+	using category = lane_tag;
+	static constexpr bool enabled = true;
+	static constexpr unsigned int threads = Threads;
+	static constexpr bool share = Share;
+};
+
+} // namespace policy
+
+namespace detail {
+
+struct config_idle {
+	using category = policy::idle_tag;
+};
+
+struct config_lane {
+	using category = policy::lane_tag;
+	static constexpr bool enabled = true;
+};
+
+template <class Tag, class Default, class... Policies> struct select_policy {
+	using type = Default;
+};
+
+template <class Tag, class Default, class P, class... Policies>
+struct select_policy<Tag, Default, P, Policies...> {
+	using type = std::conditional_t<
+	    std::is_same_v<typename P::category, Tag>, P,
+	    typename select_policy<Tag, Default, Policies...>::type>;
+};
+
+template <class Tag, class Default, class... Policies>
+using select_policy_t =
+    typename select_policy<Tag, Default, Policies...>::type;
+
+/**
+ * Per policy state of basic_pool. It is an empty base, and takes no space,
+ * unless policy needs some.
+ */
+template <class Queue> struct queue_state {};
+
+template <unsigned int N> struct queue_state<policy::batched_queue<N>> {
+	std::mutex mu;
+	tpool_batch pending{};
+	std::atomic<unsigned int> buffered{0};
+};
+
+template <class Metrics> struct metrics_state {};
+
+template <> struct metrics_state<policy::counting_metrics> {
+	std::atomic<unsigned long long> submitted{0};
+	std::atomic<unsigned long long> completed{0};
+};
+
+} // namespace detail
+
+/**
+ * Counters of a pool using policy::counting_metrics.
+ */
+struct pool_metrics {
+	unsigned long long submitted;
+	unsigned long long completed;
+};
+
+/**
+ * RAII owner of a struct tpool, specialized by policies at compile time.
+ * Disabled queue and metrics features cost neither space nor branches.
+ */
+template <class... Policies>
+class basic_pool
+    : private detail::queue_state<detail::select_policy_t<
+	  policy::queue_tag, policy::shared_queue, Policies...>>,
+      private detail::metrics_state<detail::select_policy_t<
+	  policy::metrics_tag, policy::no_metrics, Policies...>> {
+public:
+	using queue_policy = detail::select_policy_t<
+	    policy::queue_tag, policy::shared_queue, Policies...>;
+	using idle_policy = detail::select_policy_t<
+	    policy::idle_tag, detail::config_idle, Policies...>;
+	using metrics_policy = detail::select_policy_t<
+	    policy::metrics_tag, policy::no_metrics, Policies...>;
+	using lane_policy = detail::select_policy_t<
+	    policy::lane_tag, detail::config_lane, Policies...>;
+
+private:
+	static constexpr bool batched =
+	    !std::is_same_v<queue_policy, policy::shared_queue>;
+	static constexpr bool counting =
+	    std::is_same_v<metrics_policy, policy::counting_metrics>;
+
+	tpool t_{};
+
+	static tpool_config configure(tpool_config cfg)
+	{
+		if constexpr (!std::is_same_v<idle_policy,
+					      detail::config_idle>)
+			cfg.busy_poll = idle_policy::busy_poll;
+		if constexpr (!lane_policy::enabled) {
+			cfg.lane_threads = 0;
+		} else if constexpr (!std::is_same_v<lane_policy,
+						     detail::config_lane>) {
+			cfg.lane_threads = lane_policy::threads;
+			cfg.lane_share = lane_policy::share;
+		}
+		return cfg;
+	}
+
+	/**
+	 * Called once a submitted task is done.
+	 */
+	void task_done()
+	{
+		if constexpr (counting)
+			this->completed.fetch_add(1, std::memory_order_relaxed);
+		if constexpr (batched) {
+			auto n = this->buffered.load(std::memory_order_relaxed);
+			if (n > 0 && tpool_want_fork(&t_))
+				flush();
+		}
+	}
+
+	template <class F>
+	tpool_task *make_task(std::pmr::memory_resource *mr, F &&f)
+	{
+		if constexpr (counting || batched) {
+			auto fn = [this, fn = std::forward<F>(f)]() mutable {
+				fn();
+				task_done();
+			};
+			if constexpr (counting)
+				this->submitted.fetch_add(
+				    1, std::memory_order_relaxed);
+			using Fn = decltype(fn);
+			return detail::make_task(std::move(fn),
+						 &detail::task_work<Fn>, mr);
+		} else {
+			using Fn = std::decay_t<F>;
+			return detail::make_task(std::forward<F>(f),
+						 &detail::task_work<Fn>, mr);
+		}
+	}
+
+public:
+	explicit basic_pool(tpool_config cfg = {})
+	{
+		tpool_init(&t_, configure(cfg));
+	}
+
+	basic_pool(const basic_pool &) = delete;
+	basic_pool &operator=(const basic_pool &) = delete;
+
+	/**
+	 * Flushes buffered tasks, waits for queued tasks and joins threads, see
+	 * tpool_deinit().
+	 */
+	~basic_pool()
+	{
+		flush();
+		tpool_deinit(&t_);
+	}
+
+	/**
+	 * Schedules a callable, errors are reported as in tpool_schedule().
+	 * With policy::batched_queue, errors are reported by the submit that
+	 * flushes the batch, and lost if a task being done flushes it.
+	 */
+	template <class F> int submit(F &&f)
+	{
+		return submit(std::allocator_arg, recycling_resource(),
+			      std::forward<F>(f));
+	}
+
+	/**
+	 * Schedules a callable, allocating it from `mr` if it doesn't fit in
+	 * a task object. `mr` must allow deallocation from pool threads.
+	 */
+	template <class F>
+	int submit(std::allocator_arg_t, std::pmr::memory_resource *mr, F &&f)
+	{
+		tpool_task *task = make_task(mr, std::forward<F>(f));
+		if constexpr (batched) {
+			tpool_batch b{};
+			{
+				std::lock_guard<std::mutex> lock(this->mu);
+				tpool_batch_push(&this->pending,
+						 tpool_batch_from_task(task));
+				if (this->pending.size < queue_policy::size &&
+				    !tpool_want_fork(&t_)) {
+					this->buffered.store(
+					    this->pending.size,
+					    std::memory_order_relaxed);
+					return 0;
+				}
+				std::swap(b, this->pending);
+				this->buffered.store(0,
+						     std::memory_order_relaxed);
+			}
+			return tpool_schedule(&t_, b);
+		} else {
+			return tpool_schedule(&t_, tpool_batch_from_task(task));
+		}
+	}
+
+	/**
+	 * Schedules a callable on the latency-critical lane, see
+	 * tpool_schedule_lane(). Lane tasks are never buffered.
+	 */
+	template <class F> int submit_lane(F &&f)
+	{
+		return submit_lane(std::allocator_arg, recycling_resource(),
+				   std::forward<F>(f));
+	}
+
+	template <class F>
+	int submit_lane(std::allocator_arg_t, std::pmr::memory_resource *mr,
+			F &&f)
+	{
+		static_assert(lane_policy::enabled,
+			      "pool is configured without lane");
+		tpool_task *task = make_task(mr, std::forward<F>(f));
+		return tpool_schedule_lane(&t_, tpool_batch_from_task(task));
+	}
+
+	/**
+	 * Schedules a callable on the thread `key` maps to, see
+	 * tpool_schedule_affine(). Affine tasks are never buffered.
+	 */
+	template <class F> int submit_affine(std::uint64_t key, F &&f)
+	{
+		tpool_task *task =
+		    make_task(recycling_resource(), std::forward<F>(f));
+		return tpool_schedule_affine(&t_, key,
+					     tpool_batch_from_task(task));
+	}
+
+	/**
+	 * Schedules buffered tasks. No-op unless policy::batched_queue is used.
+	 */
+	int flush()
+	{
+		if constexpr (batched) {
+			tpool_batch b{};
+			{
+				std::lock_guard<std::mutex> lock(this->mu);
+				std::swap(b, this->pending);
+				this->buffered.store(0,
+						     std::memory_order_relaxed);
+			}
+			if (b.size == 0)
+				return 0;
+			return tpool_schedule(&t_, b);
+		} else {
+			return 0;
+		}
+	}
+
+	/**
+	 * Returns task counters. Only available with policy::counting_metrics.
+	 */
+	pool_metrics metrics() const
+	{
+		static_assert(counting, "pool is configured without metrics");
+		return {this->submitted.load(std::memory_order_relaxed),
+			this->completed.load(std::memory_order_relaxed)};
+	}
+
+#ifdef TPOOL_COROUTINES
+	/**
+	 * Returns an awaitable resuming the awaiting coroutine on the pool.
+	 */
+	schedule_awaiter schedule() noexcept { return schedule_awaiter(&t_); }
+
+	/**
+	 * Returns an awaitable resuming the awaiting coroutine on the pool once
+	 * `f` is set, on the same thread if it awaits on the pool.
+	 */
+	future_awaiter when_ready(tpool_future &f) noexcept
+	{
+		return future_awaiter(&t_, f);
+	}
+#endif /* TPOOL_COROUTINES */
+
+#ifdef TPOOL_SENDERS
+	/**
+	 * Returns a P2300 scheduler of the pool.
+	 */
+	scheduler get_scheduler() noexcept { return scheduler(&t_); }
+#endif /* TPOOL_SENDERS */
+
+	void pause() { tpool_pause(&t_); }
+	void resume() { tpool_resume(&t_); }
+
+	void wait_idle()
+	{
+		flush();
+		tpool_wait_idle(&t_);
+	}
+
+	tpool *native() { return &t_; }
+};
+
+/**
+ * Pool with default policies.
+ */
+using pool = basic_pool<>;
+
+/**
+ * Scope owning the tasks spawned in it. Waiting, explicitly or on destruction,
+ * executes queued tasks until all of them are done, so they may reference
+ * data of the enclosing scope. First exception thrown by a task cancels tasks
+ * that haven't started yet and is rethrown by wait().
+ */
+class task_group {
+	template <class Fn> struct call {
+		task_group *group;
+		Fn fn;
+
+		void operator()() { fn(); }
+	};
+
+	tpool *pool_;
+	tpool_join join_;
+	std::atomic<bool> cancelled_{false};
+	std::mutex mu_;
+	std::exception_ptr error_;
+	int uncaught_ = std::uncaught_exceptions();
+
+	template <class Fn> static void work(tpool_task *task) noexcept
+	{
+		auto *b = reinterpret_cast<detail::task_block *>(task);
+		call<Fn> *c = detail::stored<call<Fn>>(b);
+		task_group *g = c->group;
+
+		if (!g->cancelled_.load(std::memory_order_relaxed)) {
+			try {
+				(*c)();
+			} catch (...) {
+				g->fail(std::current_exception());
+			}
+		}
+
+		// Callable may reference enclosing scope, it must be gone
+		// before the group is.
+		detail::destroy_stored<call<Fn>>(b);
+		detail::local_cache().release(b);
+		tpool_join_done(&g->join_);
+	}
+
+	void fail(std::exception_ptr e)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mu_);
+			if (!error_)
+				error_ = std::move(e);
+		}
+		cancel();
+	}
+
+public:
+	explicit task_group(tpool *t) noexcept : pool_(t)
+	{
+		tpool_join_init(&join_);
+	}
+
+	template <class... Policies>
+	explicit task_group(basic_pool<Policies...> &p) noexcept
+	    : task_group(p.native())
+	{
+	}
+
+	task_group(const task_group &) = delete;
+	task_group &operator=(const task_group &) = delete;
+
+	/**
+	 * Waits for spawned tasks. Pending tasks are cancelled if scope is
+	 * left by an exception. Exceptions of tasks not rethrown by wait() are
+	 * dropped.
+	 */
+	~task_group()
+	{
+		if (std::uncaught_exceptions() > uncaught_)
+			cancel();
+		tpool_join_wait(pool_, &join_);
+	}
+
+	/**
+	 * Spawns a callable in the group. Tasks may spawn more tasks in their
+	 * own group.
+	 */
+	template <class F> void run(F &&f)
+	{
+		run(std::allocator_arg, recycling_resource(),
+		    std::forward<F>(f));
+	}
+
+	/**
+	 * Spawns a callable allocated from `mr` if it doesn't fit in a task
+	 * object.
+	 */
+	template <class F>
+	void run(std::allocator_arg_t, std::pmr::memory_resource *mr, F &&f)
+	{
+		using Fn = std::decay_t<F>;
+		tpool_task *task = detail::make_task(
+		    call<Fn>{this, std::forward<F>(f)}, &work<Fn>, mr);
+		tpool_fork(pool_, &join_, task);
+	}
+
+	/**
+	 * Makes tasks that haven't started yet return immediately.
+	 */
+	void cancel() noexcept
+	{
+		cancelled_.store(true, std::memory_order_relaxed);
+	}
+
+	bool is_cancelled() const noexcept
+	{
+		return cancelled_.load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * Executes queued tasks until all spawned tasks are done, then resets
+	 * group and rethrows first exception of a task, if any.
+	 */
+	void wait()
+	{
+		tpool_join_wait(pool_, &join_);
+		cancelled_.store(false, std::memory_order_relaxed);
+
+		std::exception_ptr e;
+		{
+			std::lock_guard<std::mutex> lock(mu_);
+			std::swap(e, error_);
+		}
+		if (e)
+			std::rethrow_exception(e);
+	}
+};
+
+namespace detail {
+
+/**
+ * Recursion of fork_join().
+ */
+template <class Problem, class Split, class Solve, class Combine>
+class fork_join_call {
+public:
+	using result_type =
+	    std::decay_t<std::invoke_result_t<Solve &, Problem &&>>;
+
+	fork_join_call(tpool *t, Split &split, Solve &solve, Combine &combine)
+	    : pool_(t), split_(split), solve_(solve), combine_(combine)
+	{
+	}
+
+	result_type operator()(Problem p)
+	{
+		if (!tpool_want_fork(pool_))
+			return solve_(std::move(p));
+
+		std::optional<std::pair<Problem, Problem>> halves = split_(p);
+		if (!halves)
+			return solve_(std::move(p));
+
+		// Fork first half, solve second one inline.
+		tpool_join join;
+		half h(this, &join, std::move(halves->first));
+		tpool_join_init(&join);
+		tpool_fork(pool_, &join, &h.task);
+
+		std::optional<result_type> second;
+		std::exception_ptr error;
+		try {
+			second.emplace((*this)(std::move(halves->second)));
+		} catch (...) {
+			error = std::current_exception();
+		}
+		tpool_join_wait(pool_, &join);
+
+		if (h.error)
+			std::rethrow_exception(h.error);
+		if (error)
+			std::rethrow_exception(error);
+		return combine_(std::move(*h.result), std::move(*second));
+	}
+
+private:
+	struct half : task_base {
+		fork_join_call *call;
+		tpool_join *join;
+		Problem problem;
+		std::optional<result_type> result;
+		std::exception_ptr error;
+
+		half(fork_join_call *c, tpool_join *j, Problem p)
+		    : call(c), join(j), problem(std::move(p))
+		{
+			task.work = &work;
+		}
+
+		static void work(tpool_task *task) noexcept
+		{
+			auto *h = static_cast<half *>(
+			    reinterpret_cast<task_base *>(task));
+			try {
+				h->result.emplace(
+				    (*h->call)(std::move(h->problem)));
+			} catch (...) {
+				h->error = std::current_exception();
+			}
+			tpool_join_done(h->join);
+		}
+	};
+
+	tpool *pool_;
+	Split &split_;
+	Solve &solve_;
+	Combine &combine_;
+};
+
+} // namespace detail
+
+/**
+ * Solves `problem` by recursively splitting it in halves solved in parallel.
+ * `split(const Problem &)` returns an std::optional<std::pair<Problem,
+ * Problem>>, empty if problem is too small to split. `solve(Problem)` solves
+ * a problem sequentially and `combine(R, R)` merges solutions of two halves.
+ * Each level forks only if tpool_want_fork() says threads need work, and
+ * solves its whole problem sequentially otherwise, so no cutoff needs tuning.
+ * First exception thrown is rethrown once forked halves are done.
+ */
+template <class Problem, class Split, class Solve, class Combine>
+auto fork_join(tpool *t, Problem problem, Split split, Solve solve,
+	       Combine combine)
+{
+	detail::fork_join_call<Problem, Split, Solve, Combine> call(
+	    t, split, solve, combine);
+	return call(std::move(problem));
+}
+
+template <class... Policies, class Problem, class Split, class Solve,
+	  class Combine>
+auto fork_join(basic_pool<Policies...> &p, Problem problem, Split split,
+	       Solve solve, Combine combine)
+{
+	return fork_join(p.native(), std::move(problem), std::move(split),
+			 std::move(solve), std::move(combine));
+}
+
+/**
+ * Parallel algorithms with the signatures of their std counterpart, minus the
+ * execution policy. They run on the pool installed with par::use(), or on a
+ * default pool with one thread per hardware thread. Iterators must be random
+ * access and, as with std::execution::par, an exception escaping an element
+ * access function terminates the program. Algorithms are built on fork_join(),
+ * so tasks of the pool may call them.
+ */
+namespace par {
+
+namespace detail {
+
+inline std::atomic<pool *> &installed()
+{
+	static std::atomic<pool *> p{nullptr};
+	return p;
+}
+
+template <class It> decltype(auto) at(It it, std::size_t i)
+{
+	using difference_type =
+	    typename std::iterator_traits<It>::difference_type;
+	return it[static_cast<difference_type>(i)];
+}
+
+template <class It> std::size_t length(It first, It last)
+{
+	using category = typename std::iterator_traits<It>::iterator_category;
+	static_assert(
+	    std::is_base_of_v<std::random_access_iterator_tag, category>,
+	    "parallel algorithms require random access iterators");
+	return static_cast<std::size_t>(last - first);
+}
+
+using range = threadpool::detail::index_range;
+
+/**
+ * Calls fn(begin, end) on sub ranges of [0, n), forked with fork_join() so a
+ * pool thread may call it: waiting threads execute queued tasks.
+ */
+template <class Fn> void parallel_for(tpool *t, std::size_t n, Fn &&fn)
+{
+	if (n == 0)
+		return;
+	threadpool::fork_join(
+	    t, range{0, n}, &threadpool::detail::halves,
+	    [&](range r) noexcept {
+		    fn(r.first, r.second);
+		    return true;
+	    },
+	    [](bool, bool) { return true; });
+}
+
+/**
+ * Contiguous block `b` of [0, n) split in `blocks` blocks.
+ */
+inline range block(std::size_t b, std::size_t blocks, std::size_t n)
+{
+	std::size_t q = n / blocks, r = n % blocks;
+	std::size_t first = b * q + (b < r ? b : r);
+	return {first, first + q + (b < r ? 1 : 0)};
+}
+
+/**
+ * Reduces transform(i) for i in [0, n), partial results of forked halves are
+ * combined in order.
+ */
+template <class T, class Reduce, class Transform>
+T reduce_indexes(tpool *t, std::size_t n, T init, Reduce reduce,
+		 Transform transform)
+{
+	if (n == 0)
+		return init;
+
+	T acc = threadpool::fork_join(
+	    t, range{0, n}, &threadpool::detail::halves,
+	    [&](range r) noexcept -> T {
+		    T x = transform(r.first);
+		    for (std::size_t i = r.first + 1; i < r.second; i++)
+			    x = reduce(std::move(x), transform(i));
+		    return x;
+	    },
+	    [&](T a, T b) { return reduce(std::move(a), std::move(b)); });
+	return reduce(std::move(init), std::move(acc));
+}
+
+/**
+ * Two pass scan over one block per pool thread, caller included. Blocks are
+ * reduced in parallel, then scanned in parallel starting with the reduction
+ * of preceding blocks. Input is read by first pass before second one writes
+ * so scan can be done in place.
+ */
+template <class In, class Out, class T, class Op>
+Out scan(tpool *t, In first, In last, Out d_first, std::optional<T> init,
+	 Op op, bool inclusive)
+{
+	std::size_t n = detail::length(first, last);
+	std::size_t blocks = std::size_t{t->cfg.threads_max} + 1;
+	if (n < blocks)
+		blocks = n;
+	auto fold = [&](std::optional<T> &acc, T x) {
+		if (acc)
+			acc.emplace(op(std::move(*acc), std::move(x)));
+		else
+			acc.emplace(std::move(x));
+	};
+
+	if (n == 0)
+		return d_first;
+
+	std::unique_ptr<std::optional<T>[]> partial(
+	    new std::optional<T>[blocks]);
+	parallel_for(t, blocks, [&](std::size_t begin, std::size_t end) {
+		for (std::size_t j = begin; j < end; j++) {
+			auto [b, e] = block(j, blocks, n);
+			T acc = at(first, b);
+			for (std::size_t i = b + 1; i < e; i++)
+				acc = op(std::move(acc), at(first, i));
+			partial[j].emplace(std::move(acc));
+		}
+	});
+
+	// Carry of a block is reduction of preceding ones.
+	std::optional<T> carry = init;
+	for (std::size_t j = 0; j < blocks; j++) {
+		std::optional<T> next = carry;
+		fold(next, std::move(*partial[j]));
+		partial[j] = std::move(carry);
+		carry = std::move(next);
+	}
+
+	parallel_for(t, blocks, [&](std::size_t begin, std::size_t end) {
+		for (std::size_t j = begin; j < end; j++) {
+			auto [b, e] = block(j, blocks, n);
+			std::optional<T> acc = std::move(partial[j]);
+			for (std::size_t i = b; i < e; i++) {
+				T x = at(first, i);
+				if (!inclusive)
+					at(d_first, i) = *acc;
+				fold(acc, std::move(x));
+				if (inclusive)
+					at(d_first, i) = *acc;
+			}
+		}
+	});
+
+	using difference_type =
+	    typename std::iterator_traits<Out>::difference_type;
+	return d_first + static_cast<difference_type>(n);
+}
+
+template <class It, class Comp>
+void sort(tpool *t, It first, It last, Comp &comp, unsigned int depth);
+
+/**
+ * Forked half of a parallel sort.
+ */
+template <class It, class Comp>
+struct sort_half : threadpool::detail::task_base {
+	tpool *pool;
+	tpool_join *join;
+	It first;
+	It last;
+	Comp *comp;
+	unsigned int depth;
+
+	static void work(tpool_task *task) noexcept
+	{
+		auto *h = static_cast<sort_half *>(
+		    reinterpret_cast<threadpool::detail::task_base *>(task));
+		detail::sort(h->pool, h->first, h->last, *h->comp, h->depth);
+		tpool_join_done(h->join);
+	}
+};
+
+/**
+ * Parallel quicksort. Range is split in three around a median of three pivot,
+ * lower part is forked and upper part sorted inline. Falls back to std::sort()
+ * on small ranges, once recursion gets too deep or when pool threads already
+ * have enough work, see tpool_want_fork().
+ */
+template <class It, class Comp>
+void sort(tpool *t, It first, It last, Comp &comp, unsigned int depth)
+{
+	using value_type = typename std::iterator_traits<It>::value_type;
+	std::size_t n = detail::length(first, last);
+
+	if (n <= TPOOL_PAR_SORT_CUTOFF || depth == 0 || !tpool_want_fork(t)) {
+		std::sort(first, last, comp);
+		return;
+	}
+
+	It a = first, b = first + static_cast<decltype(last - first)>(n / 2),
+	   c = last - 1;
+	if (comp(*b, *a))
+		std::swap(a, b);
+	if (comp(*c, *b))
+		b = comp(*c, *a) ? a : c;
+	value_type pivot = *b;
+
+	It lower = std::partition(
+	    first, last, [&](const value_type &x) { return comp(x, pivot); });
+	It upper = std::partition(lower, last, [&](const value_type &x) {
+		return !comp(pivot, x);
+	});
+
+	tpool_join join;
+	sort_half<It, Comp> half;
+	tpool_join_init(&join);
+	half.task.work = &sort_half<It, Comp>::work;
+	half.pool = t;
+	half.join = &join;
+	half.first = first;
+	half.last = lower;
+	half.comp = &comp;
+	half.depth = depth - 1;
+
+	tpool_fork(t, &join, &half.task);
+	detail::sort(t, upper, last, comp, depth - 1);
+	tpool_join_wait(t, &join);
+}
+
+} // namespace detail
+
+/**
+ * Makes parallel algorithms run on `p`, which must outlive their use.
+ */
+inline void use(pool &p) noexcept { detail::installed().store(&p); }
+
+/**
+ * Returns pool running parallel algorithms.
+ */
+inline pool &current()
+{
+	if (pool *p = detail::installed().load())
+		return *p;
+
+	static pool fallback([] {
+		tpool_config cfg{};
+		unsigned int n = std::thread::hardware_concurrency();
+		cfg.threads_max = n > 1 ? n - 1 : 1;
+		return cfg;
+	}());
+	return fallback;
+}
+
+template <class It, class Fn> void for_each(It first, It last, Fn f)
+{
+	detail::parallel_for(current().native(), detail::length(first, last),
+			     [&](std::size_t begin, std::size_t end) {
+				     for (std::size_t i = begin; i < end; i++)
+					     f(detail::at(first, i));
+			     });
+}
+
+template <class It, class Size, class Fn>
+It for_each_n(It first, Size n, Fn f)
+{
+	if (n <= 0)
+		return first;
+	It last = first + n;
+	par::for_each(first, last, std::move(f));
+	return last;
+}
+
+template <class In, class Out, class Op>
+Out transform(In first, In last, Out d_first, Op op)
+{
+	std::size_t n = detail::length(first, last);
+	detail::parallel_for(current().native(), n,
+			     [&](std::size_t begin, std::size_t end) {
+				     for (std::size_t i = begin; i < end; i++)
+					     detail::at(d_first, i) =
+						 op(detail::at(first, i));
+			     });
+	return d_first + (last - first);
+}
+
+template <class In1, class In2, class Out, class Op>
+Out transform(In1 first1, In1 last1, In2 first2, Out d_first, Op op)
+{
+	std::size_t n = detail::length(first1, last1);
+	detail::parallel_for(
+	    current().native(), n, [&](std::size_t begin, std::size_t end) {
+		    for (std::size_t i = begin; i < end; i++)
+			    detail::at(d_first, i) = op(detail::at(first1, i),
+							detail::at(first2, i));
+	    });
+	return d_first + (last1 - first1);
+}
+
+template <class It, class T, class Reduce, class Transform>
+T transform_reduce(It first, It last, T init, Reduce reduce,
+		   Transform transform)
+{
+	return detail::reduce_indexes(
+	    current().native(), detail::length(first, last), std::move(init),
+	    reduce, [&](std::size_t i) -> T {
+		    return transform(detail::at(first, i));
+	    });
+}
+
+template <class In1, class In2, class T, class Reduce, class Transform>
+T transform_reduce(In1 first1, In1 last1, In2 first2, T init, Reduce reduce,
+		   Transform transform)
+{
+	return detail::reduce_indexes(
+	    current().native(), detail::length(first1, last1),
+	    std::move(init), reduce, [&](std::size_t i) -> T {
+		    return transform(detail::at(first1, i),
+				     detail::at(first2, i));
+	    });
+}
+
+template <class In1, class In2, class T>
+T transform_reduce(In1 first1, In1 last1, In2 first2, T init)
+{
+	return par::transform_reduce(first1, last1, first2, std::move(init),
+				     std::plus<>(), std::multiplies<>());
+}
+
+template <class It, class T, class Op>
+T reduce(It first, It last, T init, Op op)
+{
+	return detail::reduce_indexes(
+	    current().native(), detail::length(first, last), std::move(init),
+	    op, [&](std::size_t i) -> T { return detail::at(first, i); });
+}
+
+template <class It, class T> T reduce(It first, It last, T init)
+{
+	return par::reduce(first, last, std::move(init), std::plus<>());
+}
+
+template <class It>
+typename std::iterator_traits<It>::value_type reduce(It first, It last)
+{
+	return par::reduce(first, last,
+			   typename std::iterator_traits<It>::value_type{});
+}
+
+template <class In, class Out, class Op>
+Out inclusive_scan(In first, In last, Out d_first, Op op)
+{
+	using T = typename std::iterator_traits<In>::value_type;
+	return detail::scan<In, Out, T>(current().native(), first, last,
+					d_first, std::nullopt, op, true);
+}
+
+template <class In, class Out>
+Out inclusive_scan(In first, In last, Out d_first)
+{
+	return par::inclusive_scan(first, last, d_first, std::plus<>());
+}
+
+template <class In, class Out, class T, class Op>
+Out exclusive_scan(In first, In last, Out d_first, T init, Op op)
+{
+	return detail::scan<In, Out, T>(current().native(), first, last,
+					d_first, std::move(init), op, false);
+}
+
+template <class In, class Out, class T>
+Out exclusive_scan(In first, In last, Out d_first, T init)
+{
+	return par::exclusive_scan(first, last, d_first, std::move(init),
+				   std::plus<>());
+}
+
+template <class It, class Comp> void sort(It first, It last, Comp comp)
+{
+	// Quicksort recursion is bounded as in introsort.
+	unsigned int depth = 0;
+	for (std::size_t n = detail::length(first, last); n > 1; n /= 2)
+		depth += 2;
+	detail::sort(current().native(), first, last, comp, depth);
+}
+
+template <class It> void sort(It first, It last)
+{
+	par::sort(first, last, std::less<>());
+}
+
+} // namespace par
+
+#ifdef TPOOL_COROUTINES
+
+template <class T = void> class task;
+
+namespace detail {
+
+inline std::pmr::memory_resource *&frame_resource()
+{
+	thread_local std::pmr::memory_resource *mr = recycling_resource();
+	return mr;
+}
+
+/**
+ * Allocates a coroutine frame from `mr`, which is stored after the frame so
+ * it can be freed without it.
+ */
+inline void *allocate_frame(std::size_t size, std::pmr::memory_resource *mr)
+{
+	constexpr std::size_t align = alignof(std::pmr::memory_resource *);
+	std::size_t offset = (size + align - 1) / align * align;
+	void *p = mr->allocate(offset + sizeof(mr));
+	std::memcpy(static_cast<char *>(p) + offset, &mr, sizeof(mr));
+	return p;
+}
+
+inline void deallocate_frame(void *p, std::size_t size) noexcept
+{
+	constexpr std::size_t align = alignof(std::pmr::memory_resource *);
+	std::size_t offset = (size + align - 1) / align * align;
+	std::pmr::memory_resource *mr;
+	std::memcpy(&mr, static_cast<char *>(p) + offset, sizeof(mr));
+	mr->deallocate(p, offset + sizeof(mr));
+}
+
+struct promise_base {
+	std::coroutine_handle<> continuation = std::noop_coroutine();
+	std::exception_ptr error;
+
+	static void *operator new(std::size_t size)
+	{
+		return allocate_frame(size, frame_resource());
+	}
+
+	static void operator delete(void *p, std::size_t size) noexcept
+	{
+		deallocate_frame(p, size);
+	}
+
+	/**
+	 * Completed task transfers control to its awaiter without going
+	 * through the pool.
+	 */
+	struct final_awaiter {
+		bool await_ready() const noexcept { return false; }
+
+		template <class P>
+		std::coroutine_handle<>
+		await_suspend(std::coroutine_handle<P> h) noexcept
+		{
+			return h.promise().continuation;
+		}
+
+		void await_resume() const noexcept {}
+	};
+
+	std::suspend_always initial_suspend() const noexcept { return {}; }
+	final_awaiter final_suspend() const noexcept { return {}; }
+	void unhandled_exception() noexcept
+	{
+		error = std::current_exception();
+	}
+};
+
+template <class T> struct promise : promise_base {
+	std::optional<T> value;
+
+	task<T> get_return_object() noexcept;
+
+	template <class U> void return_value(U &&v)
+	{
+		value.emplace(std::forward<U>(v));
+	}
+
+	T result()
+	{
+		if (error)
+			std::rethrow_exception(error);
+		return std::move(*value);
+	}
+};
+
+template <> struct promise<void> : promise_base {
+	task<void> get_return_object() noexcept;
+
+	void return_void() const noexcept {}
+
+	void result()
+	{
+		if (error)
+			std::rethrow_exception(error);
+	}
+};
+
+} // namespace detail
+
+/**
+ * Makes frames of task coroutines called by this thread while the scope is
+ * alive allocated from `mr`, instead of recycling_resource(). Frames remember
+ * their resource so they can be destroyed on any thread.
+ */
+class frame_resource_scope {
+	std::pmr::memory_resource *prev_;
+
+public:
+	explicit frame_resource_scope(std::pmr::memory_resource *mr) noexcept
+	    : prev_(std::exchange(detail::frame_resource(), mr))
+	{
+	}
+
+	frame_resource_scope(const frame_resource_scope &) = delete;
+	frame_resource_scope &
+	operator=(const frame_resource_scope &) = delete;
+
+	~frame_resource_scope() { detail::frame_resource() = prev_; }
+};
+
+/**
+ * Lazily started coroutine producing a T. Awaiting a task starts it and
+ * resumes the awaiter once it completes, both through symmetric transfer.
+ * Exceptions are rethrown to the awaiter.
+ */
+template <class T> class [[nodiscard]] task {
+public:
+	using promise_type = detail::promise<T>;
+	using handle_type = std::coroutine_handle<promise_type>;
+
+	explicit task(handle_type h) noexcept : h_(h) {}
+	task(task &&o) noexcept : h_(std::exchange(o.h_, nullptr)) {}
+	task(const task &) = delete;
+	task &operator=(const task &) = delete;
+
+	~task()
+	{
+		if (h_)
+			h_.destroy();
+	}
+
+	auto operator co_await() && noexcept
+	{
+		struct awaiter {
+			handle_type h;
+
+			bool await_ready() const noexcept { return false; }
+
+			std::coroutine_handle<>
+			await_suspend(std::coroutine_handle<> c) noexcept
+			{
+				h.promise().continuation = c;
+				return h;
+			}
+
+			T await_resume() { return h.promise().result(); }
+		};
+		return awaiter{h_};
+	}
+
+private:
+	handle_type h_;
+};
+
+namespace detail {
+
+template <class T> task<T> promise<T>::get_return_object() noexcept
+{
+	return task<T>(task<T>::handle_type::from_promise(*this));
+}
+
+inline task<void> promise<void>::get_return_object() noexcept
+{
+	return task<void>(task<void>::handle_type::from_promise(*this));
+}
+
+/**
+ * Coroutine driving a task for sync_wait(), signals a future on completion.
+ */
+struct sync_task {
+	struct promise_type {
+		tpool_future *done = nullptr;
+
+		sync_task get_return_object() noexcept
+		{
+			return sync_task{std::coroutine_handle<
+			    promise_type>::from_promise(*this)};
+		}
+
+		struct final_awaiter {
+			bool await_ready() const noexcept { return false; }
+
+			void await_suspend(
+			    std::coroutine_handle<promise_type> h) noexcept
+			{
+				tpool_future_set(h.promise().done, nullptr);
+			}
+
+			void await_resume() const noexcept {}
+		};
+
+		std::suspend_always initial_suspend() const noexcept
+		{
+			return {};
+		}
+		final_awaiter final_suspend() const noexcept { return {}; }
+		void return_void() const noexcept {}
+		void unhandled_exception() const noexcept { std::terminate(); }
+	};
+
+	std::coroutine_handle<promise_type> h;
+};
+
+template <class T> struct sync_result {
+	std::optional<std::conditional_t<std::is_void_v<T>, std::monostate, T>>
+	    value;
+	std::exception_ptr error;
+};
+
+template <class T> sync_task sync_run(task<T> &t, sync_result<T> &out)
+{
+	try {
+		if constexpr (std::is_void_v<T>) {
+			co_await std::move(t);
+			out.value.emplace();
+		} else {
+			out.value.emplace(co_await std::move(t));
+		}
+	} catch (...) {
+		out.error = std::current_exception();
+	}
+}
+
+} // namespace detail
+
+/**
+ * Runs a task to completion, blocking calling thread until it's done. Must
+ * not be called from a pool thread the task hops onto.
+ */
+template <class T> T sync_wait(task<T> t)
+{
+	tpool_future done;
+	detail::sync_result<T> out;
+
+	tpool_future_init(&done);
+	detail::sync_task s = detail::sync_run(t, out);
+	s.h.promise().done = &done;
+	s.h.resume();
+	tpool_future_get(&done);
+	s.h.destroy();
+
+	if (out.error)
+		std::rethrow_exception(out.error);
+	if constexpr (!std::is_void_v<T>)
+		return std::move(*out.value);
+}
+
+#endif /* TPOOL_COROUTINES */
+
+} // namespace threadpool
+
+#endif /* THREADPOOL_HPP_INCLUDE */